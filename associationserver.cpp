@@ -0,0 +1,252 @@
+#include "associationserver.h"
+#include <QDir>
+#include <QFileInfo>
+#include <QFileSystemWatcher>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QStandardPaths>
+#include <QThread>
+#include <QTimer>
+
+AssociationServer::AssociationServer(bool verbose, QObject *parent)
+	: QObject(parent), m_server(new QLocalServer(this)), m_watcher(new QFileSystemWatcher(this)),
+	  m_reloadTimer(new QTimer(this)), m_verbose(verbose)
+{
+	auto xdgMimeApps = std::make_shared<XdgMimeApps>();
+	xdgMimeApps->loadApplications(verbose);
+	xdgMimeApps->loadAllConfigs(verbose);
+	m_snapshot.publish(std::move(xdgMimeApps));
+
+	m_reloadTimer->setSingleShot(true);
+	m_reloadTimer->setInterval(200);
+
+	connect(m_server, &QLocalServer::newConnection, this, &AssociationServer::onNewConnection);
+	connect(m_watcher, &QFileSystemWatcher::directoryChanged, this, &AssociationServer::onDirectoryChanged);
+	connect(m_watcher, &QFileSystemWatcher::fileChanged, this, &AssociationServer::onFileChanged);
+	connect(m_reloadTimer, &QTimer::timeout, this, &AssociationServer::reload);
+
+	watchPaths();
+}
+
+AssociationServer::~AssociationServer()
+{
+	// The reload thread publishes into m_snapshot
+	if (m_reloadThread) {
+		m_reloadThread->wait();
+	}
+}
+
+QString AssociationServer::defaultSocketPath()
+{
+	return QDir(QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation)).absoluteFilePath("sda-qt6.socket");
+}
+
+bool AssociationServer::listen(const QString &socketPath)
+{
+	QLocalSocket probe;
+	probe.connectToServer(socketPath);
+	if (probe.waitForConnected(100)) {
+		qWarning() << "AssociationServer: Another daemon is already listening on" << socketPath;
+		return false;
+	}
+	// Clean up a stale socket left behind by a daemon that didn't exit cleanly
+	QLocalServer::removeServer(socketPath);
+	m_server->setSocketOptions(QLocalServer::UserAccessOption);
+	if (!m_server->listen(socketPath)) {
+		qWarning() << "AssociationServer: Failed to listen on" << socketPath << m_server->errorString();
+		return false;
+	}
+	qCDebug(sdaLog) << "AssociationServer: Listening on" << m_server->fullServerName();
+	return true;
+}
+
+void AssociationServer::onNewConnection()
+{
+	while (QLocalSocket *socket = m_server->nextPendingConnection()) {
+		connect(socket, &QLocalSocket::readyRead, this, [this, socket]() { readRequests(socket); });
+		connect(socket, &QLocalSocket::disconnected, socket, &QObject::deleteLater);
+		readRequests(socket);
+	}
+}
+
+void AssociationServer::readRequests(QLocalSocket *socket)
+{
+	// Longer than any MIME type and desktop ID, so a client that never ends its line can't grow the buffer forever
+	static const qint64 MAX_LINE_LENGTH = 4096;
+
+	while (socket->canReadLine()) {
+		const QByteArray data = socket->readLine();
+		if (data.size() > MAX_LINE_LENGTH) {
+			qCWarning(sdaLog) << "AssociationServer: Dropping a client that sent an overlong request";
+			socket->abort();
+			return;
+		}
+		const QString line = QString::fromUtf8(data).trimmed();
+		if (!line.isEmpty()) {
+			socket->write(handleRequest(line));
+		}
+	}
+	if (socket->bytesAvailable() > MAX_LINE_LENGTH) {
+		qCWarning(sdaLog) << "AssociationServer: Dropping a client that sent an overlong request";
+		socket->abort();
+	}
+}
+
+QByteArray AssociationServer::handleRequest(const QString &line)
+{
+	const QStringList args = line.split(' ', Qt::SkipEmptyParts);
+	const QString command = args.first().toUpper();
+
+	if (command == "PING" && args.size() == 1) {
+		return "OK\n";
+	}
+	if (command == "RELOAD" && args.size() == 1) {
+		m_reloadApplications = true;
+		reload();
+		return "OK\n";
+	}
+	// One consistent version for the whole request, even if a reload publishes a new one meanwhile
+	const XdgMimeAppsSnapshot snapshot = m_snapshot.load();
+	if (command == "DEFAULT" && args.size() == 2) {
+		const QString mimeType = snapshot->normalizeMimeType(args.at(1));
+		return "OK " + snapshot->getDefaultApp(mimeType).toUtf8() + '\n';
+	}
+	if (command == "ASSOCIATED" && args.size() == 2) {
+		const QString mimeType = snapshot->normalizeMimeType(args.at(1));
+		return "OK " + snapshot->getAssociatedApps(mimeType).join(';').toUtf8() + '\n';
+	}
+	if (command == "SET" && args.size() == 3) {
+		const QString mimeType = snapshot->normalizeMimeType(args.at(1));
+		if (mimeType.isEmpty()) {
+			return "ERR unknown mimetype\n";
+		}
+		if (!snapshot->hasDesktopId(args.at(2))) {
+			return "ERR unknown desktop id\n";
+		}
+		// Edits go to a copy, which updates itself without a reload and then replaces the snapshot
+		auto next = std::make_shared<XdgMimeApps>(*snapshot);
+		if (!next->setDefaults(QHash<QString, QString>{ { mimeType, args.at(2) } })) {
+			return "ERR could not write mimeapps.list\n";
+		}
+		publishEdit(std::move(next));
+		return "OK\n";
+	}
+	if (command == "UNSET" && args.size() == 2) {
+		const QString mimeType = snapshot->normalizeMimeType(args.at(1));
+		if (mimeType.isEmpty()) {
+			return "ERR unknown mimetype\n";
+		}
+		auto next = std::make_shared<XdgMimeApps>(*snapshot);
+		next->removeDefaults({ mimeType });
+		publishEdit(std::move(next));
+		return "OK\n";
+	}
+	return "ERR bad request\n";
+}
+
+void AssociationServer::publishEdit(std::shared_ptr<const XdgMimeApps> next)
+{
+	m_snapshot.publish(std::move(next));
+	// A running reload started from the version before the edit and won't publish, so it has to be redone
+	if (m_reloadThread) {
+		m_reloadApplications = m_reloadApplications || m_reloadingApplications;
+		m_reloadPending = true;
+	}
+}
+
+void AssociationServer::onDirectoryChanged(const QString &path)
+{
+	if (m_applicationDirs.contains(path)) {
+		m_reloadApplications = true;
+	}
+	m_reloadTimer->start();
+}
+
+void AssociationServer::onFileChanged(const QString &path)
+{
+	Q_UNUSED(path);
+	m_reloadTimer->start();
+}
+
+/**
+ * Builds the next snapshot on a background thread, requests keep being answered
+ * from the current one until it is published.
+ */
+void AssociationServer::reload()
+{
+	if (m_reloadThread) {
+		// Changes that arrive during a reload may have been missed by it, go again afterwards
+		m_reloadPending = true;
+		return;
+	}
+
+	// Configs are cheap to re-read, applications only need a rescan if their directories changed
+	const bool reloadApplications = m_reloadApplications;
+	m_reloadApplications = false;
+	m_reloadingApplications = reloadApplications;
+	const XdgMimeAppsSnapshot current = m_snapshot.load();
+	const bool verbose = m_verbose;
+	m_reloadThread = QThread::create([this, current, reloadApplications, verbose]() {
+		std::shared_ptr<XdgMimeApps> next;
+		if (reloadApplications) {
+			qCDebug(sdaLog) << "AssociationServer: Reloading applications";
+			next = std::make_shared<XdgMimeApps>(current->environment());
+			next->loadApplications(verbose);
+		} else {
+			next = std::make_shared<XdgMimeApps>(*current);
+		}
+		qCDebug(sdaLog) << "AssociationServer: Reloading mimeapps.list files";
+		next->loadAllConfigs(verbose);
+		// An edit published meanwhile is newer, publishEdit() already queued another reload
+		if (!m_snapshot.publishIfCurrent(current, std::move(next))) {
+			qCDebug(sdaLog) << "AssociationServer: Dropping a reload overtaken by an edit";
+		}
+	});
+	connect(m_reloadThread, &QThread::finished, this, [this]() {
+		m_reloadThread->deleteLater();
+		m_reloadThread = nullptr;
+		// Atomic saves replace files, which drops them from the watcher
+		watchPaths();
+		if (m_reloadPending) {
+			m_reloadPending = false;
+			reload();
+		}
+	});
+	m_reloadThread->start();
+}
+
+void AssociationServer::watchPaths()
+{
+	QStringList paths;
+	const XdgMimeAppsSnapshot snapshot = m_snapshot.load();
+	for (const QString &path : snapshot->getMimeAppsListPaths()) {
+		const QFileInfo fileInfo(path);
+		if (fileInfo.exists()) {
+			paths.append(path);
+		}
+		// Watch the directory as well so newly created files are noticed
+		const QString dirPath = QDir::cleanPath(fileInfo.absolutePath());
+		if (QFileInfo::exists(dirPath)) {
+			paths.append(dirPath);
+		}
+	}
+
+	// Subdirectories too, desktop files in e.g. applications/kde4/ have prefixed desktop IDs
+	m_applicationDirs.clear();
+	for (const QString &dirPath : snapshot->environment().applicationDirs() + snapshot->getScannedApplicationDirs()) {
+		if (QFileInfo::exists(dirPath)) {
+			const QString cleanPath = QDir::cleanPath(dirPath);
+			m_applicationDirs.insert(cleanPath);
+			paths.append(cleanPath);
+		}
+	}
+
+	paths.removeDuplicates();
+	const QStringList watched = m_watcher->files() + m_watcher->directories();
+	for (const QString &path : watched) {
+		paths.removeOne(path);
+	}
+	if (!paths.isEmpty()) {
+		m_watcher->addPaths(paths);
+	}
+}
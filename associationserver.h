@@ -0,0 +1,66 @@
+#pragma once
+
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include "atomicsnapshot.h"
+#include "xdgmimeapps.h"
+
+class QFileSystemWatcher;
+class QLocalServer;
+class QLocalSocket;
+class QThread;
+class QTimer;
+
+/**
+ * @brief Resident daemon answering association queries over a local socket.
+ *
+ * Keeps an XdgMimeApps snapshot loaded and replaces it when the watched
+ * mimeapps.list files or application directories change, so a query costs
+ * a socket round-trip instead of a cold parse of every XDG file. Reloads run
+ * in the background; queries are answered from the previous snapshot meanwhile.
+ *
+ * The protocol is line based and UTF-8, one request per line:
+ *   DEFAULT <mimetype>              -> OK <desktop-id>   (empty if there is no default)
+ *   ASSOCIATED <mimetype>           -> OK <id>;<id>;...
+ *   SET <mimetype> <desktop-id>     -> OK
+ *   UNSET <mimetype>                -> OK
+ *   RELOAD                          -> OK
+ *   PING                            -> OK
+ * Failures are answered with "ERR <message>".
+ */
+class AssociationServer : public QObject {
+	Q_OBJECT
+
+public:
+	explicit AssociationServer(bool verbose, QObject *parent = nullptr);
+	~AssociationServer() override;
+
+	bool listen(const QString &socketPath);
+	static QString defaultSocketPath();
+
+private slots:
+	void onNewConnection();
+	void onDirectoryChanged(const QString &path);
+	void onFileChanged(const QString &path);
+	void reload();
+
+private:
+	void readRequests(QLocalSocket *socket);
+	QByteArray handleRequest(const QString &line);
+	void publishEdit(std::shared_ptr<const XdgMimeApps> next);
+	void watchPaths();
+
+	AtomicSnapshot<XdgMimeApps> m_snapshot;
+	QThread *m_reloadThread = nullptr;
+	bool m_reloadPending = false;
+	// Whether the running reload rescans applications, a redo after an edit must as well
+	bool m_reloadingApplications = false;
+	QLocalServer *m_server;
+	QFileSystemWatcher *m_watcher;
+	// Coalesces bursts of change notifications (e.g. a package manager run) into one reload
+	QTimer *m_reloadTimer;
+	QSet<QString> m_applicationDirs;
+	bool m_reloadApplications = false;
+	bool m_verbose;
+};
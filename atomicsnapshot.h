@@ -0,0 +1,42 @@
+#pragma once
+
+#include <memory>
+
+/**
+ * @brief Holds the current version of some immutable state for concurrent readers.
+ *
+ * Readers take a reference with load() and keep using that version for as long as
+ * they hold it, even while a writer publishes a newer one. A version is freed when
+ * its last reader lets go, so reloading never has to wait for readers.
+ */
+template<typename T>
+class AtomicSnapshot {
+public:
+	AtomicSnapshot() = default;
+	explicit AtomicSnapshot(std::shared_ptr<const T> initial) : m_current(std::move(initial))
+	{
+	}
+
+	std::shared_ptr<const T> load() const
+	{
+		return std::atomic_load_explicit(&m_current, std::memory_order_acquire);
+	}
+
+	void publish(std::shared_ptr<const T> next)
+	{
+		std::atomic_store_explicit(&m_current, std::move(next), std::memory_order_release);
+	}
+
+	/**
+	 * Publishes next only if expected is still the current version, so a writer that
+	 * derived next from an older version can't overwrite a newer one. Returns whether it did.
+	 */
+	bool publishIfCurrent(std::shared_ptr<const T> expected, std::shared_ptr<const T> next)
+	{
+		return std::atomic_compare_exchange_strong_explicit(&m_current, &expected, std::move(next),
+								    std::memory_order_acq_rel, std::memory_order_acquire);
+	}
+
+private:
+	std::shared_ptr<const T> m_current;
+};
@@ -0,0 +1,123 @@
+#include "batchresolver.h"
+#include "runtimestats.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QIODevice>
+#include <QThreadPool>
+#include <QUrl>
+#include <algorithm>
+#include <vector>
+
+// Lines read before the pool starts on them, bounds memory for arbitrarily long inputs
+static const int CHUNK_LINES = 16384;
+// Lines per pool task, large enough that scheduling doesn't dominate name-only matches
+static const int TASK_LINES = 256;
+
+static const QString X_SCHEME_HANDLER = QStringLiteral("x-scheme-handler/");
+
+BatchResolver::BatchResolver(bool verbose)
+{
+	XdgMimeApps xdgMimeApps;
+	xdgMimeApps.loadApplications(verbose);
+	xdgMimeApps.loadAllConfigs(verbose);
+	m_handlers = xdgMimeApps.resolveEffectiveHandlers();
+}
+
+qint64 BatchResolver::run(QIODevice &in, FILE *out) const
+{
+	qint64 unresolved = 0;
+	QThreadPool pool;
+	QList<QByteArray> lines;
+	lines.reserve(CHUNK_LINES);
+	while (true) {
+		lines.clear();
+		while (lines.size() < CHUNK_LINES && !in.atEnd()) {
+			QByteArray line = in.readLine();
+			if (line.endsWith('\n')) {
+				line.chop(1);
+			}
+			// Lists written on Windows end their lines with CRLF
+			if (line.endsWith('\r')) {
+				line.chop(1);
+			}
+			// A tab would make the output columns ambiguous, no file name worth resolving has one
+			if (line.contains('\t')) {
+				fprintf(stderr, "Skipping input with a tab: %s\n", line.replace('\t', "\\t").constData());
+				unresolved++;
+			} else if (!line.isEmpty()) {
+				lines.append(line);
+			}
+		}
+		if (lines.isEmpty()) {
+			break;
+		}
+
+		// Each slot is written by exactly one task, so no locking is needed
+		std::vector<QByteArray> results(lines.size());
+		for (qsizetype begin = 0; begin < lines.size(); begin += TASK_LINES) {
+			const qsizetype end = std::min<qsizetype>(begin + TASK_LINES, lines.size());
+			pool.start([this, &lines, &results, begin, end]() {
+				for (qsizetype i = begin; i < end; i++) {
+					results[i] = resolve(lines[i]);
+				}
+			});
+		}
+		pool.waitForDone();
+
+		for (const QByteArray &result : results) {
+			fwrite(result.constData(), 1, result.size(), out);
+			// An empty last field means no handler
+			if (result.endsWith("\t\n")) {
+				unresolved++;
+			}
+		}
+		fflush(out);
+	}
+	return unresolved;
+}
+
+QByteArray BatchResolver::resolve(const QByteArray &line) const
+{
+	const QString input = QFile::decodeName(line);
+	QString mimeName;
+	QString handler;
+
+	// Paths are the common case, only something that looks like "scheme:" is a URI. Without
+	// a ":/" that could also be a relative file name like "notes:v2.txt", which wins if it exists.
+	const QUrl url(input, QUrl::StrictMode);
+	const bool hasScheme = !input.startsWith('/') && url.isValid() && !url.scheme().isEmpty() && !url.isLocalFile();
+	if (hasScheme && (input.contains(u":/") || !QFileInfo::exists(input))) {
+		mimeName = X_SCHEME_HANDLER + url.scheme().toLower();
+		handler = m_handlers.value(mimeName).desktopId;
+	} else {
+		const QMimeType mimeType =
+			m_mimeDb.mimeTypeForFile(url.isLocalFile() ? url.toLocalFile() : input, QMimeDatabase::MatchDefault);
+		RuntimeStats::add(RuntimeStats::MimeLookups);
+		mimeName = mimeType.name();
+		handler = handlerFor(mimeType);
+	}
+	// The input is echoed as read, names that aren't valid in the locale's encoding stay intact
+	return line + '\t' + (mimeName + '\t' + handler).toUtf8() + '\n';
+}
+
+// The type itself, then its aliases as mimeapps.list may use those, then the types it inherits from
+QString BatchResolver::handlerFor(const QMimeType &mimeType) const
+{
+	auto handler = m_handlers.constFind(mimeType.name());
+	if (handler != m_handlers.constEnd()) {
+		return handler->desktopId;
+	}
+	for (const QString &alias : mimeType.aliases()) {
+		handler = m_handlers.constFind(alias);
+		if (handler != m_handlers.constEnd()) {
+			return handler->desktopId;
+		}
+	}
+	for (const QString &ancestor : mimeType.allAncestors()) {
+		handler = m_handlers.constFind(ancestor);
+		if (handler != m_handlers.constEnd()) {
+			return handler->desktopId;
+		}
+	}
+	return QString();
+}
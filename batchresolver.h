@@ -0,0 +1,41 @@
+#pragma once
+
+#include <QHash>
+#include <QMimeDatabase>
+#include <QString>
+#include <QStringList>
+#include <cstdio>
+#include "xdgmimeapps.h"
+
+class QIODevice;
+
+/**
+ * @brief Classifies many file paths and URIs against the loaded associations.
+ *
+ * Every input line is a file path, a file:// URI or any other URI. Files get their
+ * MIME type from name and content, other URIs resolve as x-scheme-handler/<scheme>.
+ * The effective handlers are resolved once up front; lines are read in chunks whose
+ * detection runs on a thread pool, and the output keeps the input order.
+ *
+ * Output is one tab separated line per input: the input bytes as read, the MIME type
+ * and the handler's desktop ID, the last two empty when unknown. Inputs containing a
+ * tab are reported on stderr instead and count as unresolved.
+ */
+class BatchResolver {
+public:
+	explicit BatchResolver(bool verbose);
+
+	/**
+	 * @brief Resolve every line of @p in, writing results to @p out as they complete.
+	 * @return Number of inputs without a handler
+	 */
+	qint64 run(QIODevice &in, FILE *out) const;
+
+private:
+	QByteArray resolve(const QByteArray &line) const;
+	QString handlerFor(const QMimeType &mimeType) const;
+
+	QHash<QString, XdgMimeApps::EffectiveHandler> m_handlers;
+	// Thread safe, all instances share one database
+	QMimeDatabase m_mimeDb;
+};
@@ -0,0 +1,310 @@
+#include "selectdefaultapplication.h"
+#include "runtimestats.h"
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QListWidget>
+#include <QMimeDatabase>
+#include <QTemporaryDir>
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+
+/**
+ * Times what users of the GUI wait for, on the offscreen platform against a generated XDG tree:
+ * construction, first paint, the end of background loading, typing in the search box, selecting
+ * the application with the most MIME types, switching groups and a set/remove cycle.
+ *
+ * Everything XDG (data, config and cache homes) points into a temporary directory, so runs are
+ * repeatable and never touch the user's files. Only the system's shared-mime-info database is
+ * linked in, the MIME types are real.
+ */
+class GuiBenchmark : public QObject {
+public:
+	GuiBenchmark(int applications, int repetitions) : m_applications(applications), m_repetitions(repetitions)
+	{
+	}
+
+	bool setUpEnvironment(const QString &root);
+	void generateFixtures();
+	void run();
+
+protected:
+	bool eventFilter(QObject *watched, QEvent *event) override
+	{
+		if (event->type() == QEvent::Paint && m_firstPaint < 0) {
+			m_firstPaint = m_sinceConstruction.nsecsElapsed();
+		}
+		return QObject::eventFilter(watched, event);
+	}
+
+private:
+	static const QString LARGEST_APP;
+
+	void startUp(const QString &label);
+	void report(const QString &name, QList<qint64> nanoseconds) const;
+	bool waitFor(const std::function<bool()> &condition) const;
+	QListWidgetItem *findApplication(SelectDefaultApplication &window, const QString &appName) const;
+
+	QString m_root;
+	int m_applications;
+	int m_repetitions;
+	QElapsedTimer m_sinceConstruction;
+	qint64 m_firstPaint = -1;
+};
+
+const QString GuiBenchmark::LARGEST_APP = QStringLiteral("Benchmark Largest");
+
+bool GuiBenchmark::setUpEnvironment(const QString &root)
+{
+	m_root = root;
+
+	// Link the real MIME database into the otherwise empty system data directory
+	QString mimeDir;
+	const QStringList dataDirs =
+		qEnvironmentVariable("XDG_DATA_DIRS", "/usr/local/share:/usr/share").split(':', Qt::SkipEmptyParts);
+	for (const QString &dataDir : dataDirs) {
+		if (QFileInfo::exists(dataDir + "/mime/mime.cache")) {
+			mimeDir = dataDir + "/mime";
+			break;
+		}
+	}
+	QDir().mkpath(root + "/system");
+	if (!mimeDir.isEmpty() && !QFile::link(mimeDir, root + "/system/mime")) {
+		fprintf(stderr, "Could not link %s\n", qPrintable(mimeDir));
+		return false;
+	}
+
+	qputenv("XDG_DATA_HOME", QFile::encodeName(root + "/data"));
+	qputenv("XDG_DATA_DIRS", QFile::encodeName(root + "/system"));
+	qputenv("XDG_CONFIG_HOME", QFile::encodeName(root + "/config"));
+	qputenv("XDG_CONFIG_DIRS", QFile::encodeName(root + "/system-config"));
+	qputenv("XDG_CACHE_HOME", QFile::encodeName(root + "/cache"));
+	return true;
+}
+
+void GuiBenchmark::generateFixtures()
+{
+	QStringList mimeTypes;
+	for (const QMimeType &mimeType : QMimeDatabase().allMimeTypes()) {
+		mimeTypes.append(mimeType.name());
+	}
+	mimeTypes.sort();
+
+	const QString appDir = m_root + "/data/applications";
+	QDir().mkpath(appDir + "/vendor");
+	const auto writeDesktopFile = [](const QString &path, const QString &name, const QStringList &types) {
+		QFile file(path);
+		if (file.open(QIODevice::WriteOnly)) {
+			file.write(QString("[Desktop Entry]\nType=Application\nName=%1\nName[de]=%1 (de)\n"
+					   "Icon=application-x-executable\nExec=true %f\nMimeType=%2;\n")
+					   .arg(name, types.join(';'))
+					   .toUtf8());
+		}
+	};
+
+	// One application that declares half of all types, the worst case for selection
+	QStringList largest;
+	for (int i = 0; i < mimeTypes.size(); i += 2) {
+		largest.append(mimeTypes[i]);
+	}
+	writeDesktopFile(appDir + "/benchmark-largest.desktop", LARGEST_APP, largest);
+
+	for (int i = 1; i < m_applications; i++) {
+		QStringList types;
+		for (int k = 0; k < 8; k++) {
+			types.append(mimeTypes[(i * 7 + k * 31) % mimeTypes.size()]);
+		}
+		// Every tenth one in a subdirectory, with a prefixed desktop ID
+		const QString path = i % 10 == 0 ? QString("%1/vendor/app-%2.desktop").arg(appDir).arg(i)
+						 : QString("%1/benchmark-app-%2.desktop").arg(appDir).arg(i);
+		writeDesktopFile(path, QString("Benchmark Application %1").arg(i), types);
+	}
+
+	// Defaults only for types the largest application doesn't declare, so set/remove never asks
+	QDir().mkpath(m_root + "/config");
+	QFile mimeappsList(m_root + "/config/mimeapps.list");
+	if (mimeappsList.open(QIODevice::WriteOnly)) {
+		mimeappsList.write("[Default Applications]\n");
+		for (int i = 1; i < mimeTypes.size(); i += 2) {
+			mimeappsList.write(QString("%1=benchmark-app-%2.desktop\n")
+						   .arg(mimeTypes[i])
+						   .arg(1 + i % std::max(1, m_applications - 1))
+						   .toUtf8());
+		}
+	}
+}
+
+bool GuiBenchmark::waitFor(const std::function<bool()> &condition) const
+{
+	QElapsedTimer timeout;
+	timeout.start();
+	while (!condition()) {
+		if (timeout.elapsed() > 60000) {
+			return false;
+		}
+		QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+	}
+	return true;
+}
+
+QListWidgetItem *GuiBenchmark::findApplication(SelectDefaultApplication &window, const QString &appName) const
+{
+	for (int i = 0; i < window.m_applicationList->count(); i++) {
+		QListWidgetItem *item = window.m_applicationList->item(i);
+		if (item->data(Qt::UserRole).toString() == appName) {
+			return item;
+		}
+	}
+	return nullptr;
+}
+
+void GuiBenchmark::report(const QString &name, QList<qint64> nanoseconds) const
+{
+	if (nanoseconds.isEmpty()) {
+		printf("%-40s no samples\n", qPrintable(name));
+		return;
+	}
+	std::sort(nanoseconds.begin(), nanoseconds.end());
+	printf("%-40s n=%-4lld median %9.3f ms   max %9.3f ms\n", qPrintable(name),
+	       static_cast<long long>(nanoseconds.size()), nanoseconds[nanoseconds.size() / 2] / 1e6,
+	       nanoseconds.last() / 1e6);
+}
+
+// Constructor, first paint and end of loading for one window; the first run has cold caches
+void GuiBenchmark::startUp(const QString &label)
+{
+	m_firstPaint = -1;
+	m_sinceConstruction.start();
+	SelectDefaultApplication window(nullptr, false);
+	const qint64 constructed = m_sinceConstruction.nsecsElapsed();
+	window.installEventFilter(this);
+	window.show();
+	const bool painted = waitFor([this]() { return m_firstPaint >= 0; });
+	const bool loaded = waitFor([&window]() { return window.m_searchBox->isEnabled(); });
+	const qint64 interactive = m_sinceConstruction.nsecsElapsed();
+
+	report("constructor (" + label + ")", { constructed });
+	report("first paint (" + label + ")", painted ? QList<qint64>{ m_firstPaint } : QList<qint64>{});
+	report("interactive (" + label + ")", loaded ? QList<qint64>{ interactive } : QList<qint64>{});
+}
+
+void GuiBenchmark::run()
+{
+	startUp("cold caches");
+	startUp("warm caches");
+
+	SelectDefaultApplication window(nullptr, false);
+	window.show();
+	if (!waitFor([&window]() { return window.m_searchBox->isEnabled(); })) {
+		fprintf(stderr, "Loading did not finish\n");
+		return;
+	}
+	QElapsedTimer timer;
+
+	// Each prefix of a query, like typing it; includes repainting the list
+	QList<qint64> keystrokes;
+	const QString query = QStringLiteral("benchmark application 12");
+	for (int repetition = 0; repetition < m_repetitions; repetition++) {
+		for (int length = 1; length <= query.size(); length++) {
+			timer.start();
+			window.populateApplicationList(query.left(length));
+			window.m_applicationList->repaint();
+			keystrokes.append(timer.nsecsElapsed());
+		}
+	}
+	report("populateApplicationList per keystroke", keystrokes);
+
+	window.populateApplicationList(QString());
+	QListWidgetItem *largest = findApplication(window, LARGEST_APP);
+	if (!largest) {
+		fprintf(stderr, "%s is missing from the list\n", qPrintable(LARGEST_APP));
+		return;
+	}
+	QList<qint64> selections;
+	for (int repetition = 0; repetition < m_repetitions; repetition++) {
+		window.m_applicationList->blockSignals(true);
+		window.m_applicationList->setCurrentItem(largest);
+		window.m_applicationList->blockSignals(false);
+		timer.start();
+		window.onApplicationSelected();
+		window.repaint();
+		selections.append(timer.nsecsElapsed());
+	}
+	report("onApplicationSelected (largest app)", selections);
+
+	QList<qint64> groups;
+	const QList<QAction *> actions = window.m_mimegroupMenu->actions();
+	for (int repetition = 0; repetition < m_repetitions; repetition++) {
+		for (QAction *action : actions) {
+			timer.start();
+			window.constrictGroup(action);
+			window.repaint();
+			groups.append(timer.nsecsElapsed());
+		}
+	}
+	report("constrictGroup", groups);
+
+	// Back to all groups, then set every type of the largest application and remove them again
+	for (QAction *action : actions) {
+		if (action->text() == SelectDefaultApplication::tr("All")) {
+			window.constrictGroup(action);
+		}
+	}
+	QList<qint64> cycles;
+	for (int repetition = 0; repetition < m_repetitions; repetition++) {
+		largest = findApplication(window, LARGEST_APP);
+		window.m_applicationList->setCurrentItem(largest);
+		window.m_mimetypeList->selectAll();
+		timer.start();
+		window.onSetDefaultClicked();
+		window.m_currentDefaultApps->selectAll();
+		window.onRemoveDefaultClicked();
+		window.repaint();
+		cycles.append(timer.nsecsElapsed());
+	}
+	report("set/remove cycle (largest app)", cycles);
+
+	if (RuntimeStats::isEnabled()) {
+		fputs(qPrintable(window.statisticsReport()), stdout);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	// Widgets are still laid out and painted, just not shown on any screen
+	if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+		qputenv("QT_QPA_PLATFORM", "offscreen");
+	}
+
+	QApplication app(argc, argv);
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Offscreen GUI benchmark for Select Default Application");
+	parser.addHelpOption();
+	QCommandLineOption applications("applications", "Number of generated applications (default: 2000)", "count",
+					"2000");
+	parser.addOption(applications);
+	QCommandLineOption repetitions("repetitions", "Repetitions of each interaction (default: 5)", "count", "5");
+	parser.addOption(repetitions);
+	QCommandLineOption stats("stats", "Print the --stats report of the benchmarked window");
+	parser.addOption(stats);
+	parser.process(app);
+
+	QTemporaryDir root;
+	if (!root.isValid()) {
+		fprintf(stderr, "Could not create a temporary directory\n");
+		return 1;
+	}
+
+	GuiBenchmark benchmark(std::max(2, parser.value(applications).toInt()),
+			       std::max(1, parser.value(repetitions).toInt()));
+	if (!benchmark.setUpEnvironment(root.path())) {
+		return 1;
+	}
+	RuntimeStats::setEnabled(parser.isSet(stats));
+	benchmark.generateFixtures();
+	benchmark.run();
+	return 0;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/**
+ * @brief Recognizes the keys of a [Desktop Entry] group with a single table probe.
+ *
+ * The table is a perfect hash over every key of the Desktop Entry specification,
+ * its seed is searched by the compiler, so adding a key can never introduce a
+ * collision unnoticed. Locale suffixes ("Name[de_DE@euro]") are split off before
+ * hashing, and reported separately.
+ */
+namespace DesktopEntryKeys {
+
+enum class Key : std::uint8_t {
+	Unknown,
+	Type,
+	Version,
+	Name,
+	GenericName,
+	NoDisplay,
+	Comment,
+	Icon,
+	Hidden,
+	OnlyShowIn,
+	NotShowIn,
+	DBusActivatable,
+	TryExec,
+	Exec,
+	Path,
+	Terminal,
+	Actions,
+	MimeType,
+	Categories,
+	Implements,
+	Keywords,
+	StartupNotify,
+	StartupWMClass,
+	URL,
+	PrefersNonDefaultGPU,
+	SingleMainWindow,
+};
+
+struct KeyName {
+	std::string_view name;
+	Key key;
+};
+
+constexpr KeyName KEY_NAMES[] = {
+	{ "Type", Key::Type },
+	{ "Version", Key::Version },
+	{ "Name", Key::Name },
+	{ "GenericName", Key::GenericName },
+	{ "NoDisplay", Key::NoDisplay },
+	{ "Comment", Key::Comment },
+	{ "Icon", Key::Icon },
+	{ "Hidden", Key::Hidden },
+	{ "OnlyShowIn", Key::OnlyShowIn },
+	{ "NotShowIn", Key::NotShowIn },
+	{ "DBusActivatable", Key::DBusActivatable },
+	{ "TryExec", Key::TryExec },
+	{ "Exec", Key::Exec },
+	{ "Path", Key::Path },
+	{ "Terminal", Key::Terminal },
+	{ "Actions", Key::Actions },
+	{ "MimeType", Key::MimeType },
+	{ "Categories", Key::Categories },
+	{ "Implements", Key::Implements },
+	{ "Keywords", Key::Keywords },
+	{ "StartupNotify", Key::StartupNotify },
+	{ "StartupWMClass", Key::StartupWMClass },
+	{ "URL", Key::URL },
+	{ "PrefersNonDefaultGPU", Key::PrefersNonDefaultGPU },
+	{ "SingleMainWindow", Key::SingleMainWindow },
+};
+constexpr std::size_t KEY_COUNT = sizeof(KEY_NAMES) / sizeof(KEY_NAMES[0]);
+
+// A power of two a few times the key count, so a seed without collisions turns up quickly
+constexpr std::size_t TABLE_SIZE = 128;
+static_assert(KEY_COUNT < TABLE_SIZE && KEY_COUNT < 255, "Desktop entry key table is too small");
+
+// Seeded FNV-1a
+constexpr std::uint32_t hashKey(std::string_view key, std::uint32_t seed)
+{
+	std::uint32_t hash = 2166136261u ^ seed;
+	for (const char c : key) {
+		hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+	}
+	return hash ^ (hash >> 16);
+}
+
+constexpr bool isCollisionFree(std::uint32_t seed)
+{
+	std::array<bool, TABLE_SIZE> used{};
+	for (const KeyName &keyName : KEY_NAMES) {
+		const std::size_t slot = hashKey(keyName.name, seed) % TABLE_SIZE;
+		if (used[slot]) {
+			return false;
+		}
+		used[slot] = true;
+	}
+	return true;
+}
+
+constexpr std::uint32_t findSeed()
+{
+	std::uint32_t seed = 0;
+	while (!isCollisionFree(seed)) {
+		seed++;
+	}
+	return seed;
+}
+
+constexpr std::uint32_t SEED = findSeed();
+
+// Slot -> index into KEY_NAMES plus one, 0 for empty slots
+constexpr std::array<std::uint8_t, TABLE_SIZE> buildTable()
+{
+	std::array<std::uint8_t, TABLE_SIZE> table{};
+	for (std::size_t i = 0; i < KEY_COUNT; i++) {
+		table[hashKey(KEY_NAMES[i].name, SEED) % TABLE_SIZE] = static_cast<std::uint8_t>(i + 1);
+	}
+	return table;
+}
+
+constexpr std::array<std::uint8_t, TABLE_SIZE> TABLE = buildTable();
+
+struct Classified {
+	Key key = Key::Unknown;
+	// What's between the brackets of a localized key, empty otherwise
+	std::string_view locale;
+};
+
+/**
+ * @brief Classify a key as written in the file, e.g. "MimeType" or "Name[pt_BR]".
+ *
+ * Extension keys (X-...) and anything not in the specification are Key::Unknown.
+ */
+constexpr Classified classify(std::string_view key)
+{
+	Classified result;
+	const std::size_t bracket = key.find('[');
+	if (bracket != std::string_view::npos) {
+		if (key.back() != ']' || bracket + 2 >= key.size()) {
+			return result;
+		}
+		result.locale = key.substr(bracket + 1, key.size() - bracket - 2);
+		key = key.substr(0, bracket);
+	}
+	const std::uint8_t entry = TABLE[hashKey(key, SEED) % TABLE_SIZE];
+	if (entry != 0 && KEY_NAMES[entry - 1].name == key) {
+		result.key = KEY_NAMES[entry - 1].key;
+	}
+	return result;
+}
+
+static_assert(classify("MimeType").key == Key::MimeType, "Desktop entry key table is broken");
+static_assert(classify("Name[de_DE@euro]").locale == "de_DE@euro", "Locale suffixes are not split off");
+static_assert(classify("X-KDE-Protocols").key == Key::Unknown, "Extension keys must not match");
+
+} // namespace DesktopEntryKeys
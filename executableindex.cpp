@@ -0,0 +1,238 @@
+#include "executableindex.h"
+#include "runtimestats.h"
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QLoggingCategory>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <unistd.h>
+
+Q_DECLARE_LOGGING_CATEGORY(sdaLog)
+
+// Bump when the layout of the executable cache changes
+static const quint32 EXECUTABLE_CACHE_VERSION = 1;
+// Like the kernel's limit, a longer chain is taken to be a loop
+static const int MAX_SYMLINKS = 40;
+
+// Target of a symlink as stored, QFileInfo would already resolve absolute ones against this system
+static QString readLink(const QString &path)
+{
+	QByteArray target(4096, Qt::Uninitialized);
+	const ssize_t length = readlink(QFile::encodeName(path).constData(), target.data(), target.size());
+	return length <= 0 || length >= target.size() ? QString() : QFile::decodeName(target.first(length));
+}
+
+/**
+ * Resolves an absolute path inside root like a chroot would: absolute links start over
+ * at root and ".." stops there, so links in an image can't point at this system's files.
+ * Empty for links that loop or can't be read.
+ */
+QString ExecutableIndex::resolveBelowRoot(const QString &root, const QString &path)
+{
+	QStringList pending = path.split('/', Qt::SkipEmptyParts);
+	QStringList resolved;
+	int links = 0;
+	while (!pending.isEmpty()) {
+		const QString component = pending.takeFirst();
+		if (component == ".") {
+			continue;
+		}
+		if (component == "..") {
+			if (!resolved.isEmpty()) {
+				resolved.removeLast();
+			}
+			continue;
+		}
+		const QString candidate = root + '/' + (resolved + QStringList(component)).join('/');
+		if (!QFileInfo(candidate).isSymLink()) {
+			resolved.append(component);
+			continue;
+		}
+		const QString target = readLink(candidate);
+		if (target.isEmpty() || ++links > MAX_SYMLINKS) {
+			return QString();
+		}
+		if (target.startsWith('/')) {
+			resolved.clear();
+		}
+		pending = target.split('/', Qt::SkipEmptyParts) + pending;
+	}
+	return root + '/' + resolved.join('/');
+}
+
+void ExecutableIndex::load(const QStringList &dirs, const QString &root, bool persist)
+{
+	m_executables.clear();
+	m_dirs.clear();
+	m_root = root;
+	m_loaded = true;
+
+	const QHash<QString, DirectoryListing> cached = readCache();
+	QHash<QString, DirectoryListing> listings;
+	for (const QString &dirPath : dirs) {
+		if (m_dirs.contains(dirPath)) {
+			continue;
+		}
+		m_dirs.insert(dirPath);
+		const DirectoryListing listing = listDirectory(dirPath, m_root, cached.value(dirPath));
+		if (listing.mtime == 0) {
+			continue;
+		}
+		for (const QByteArray &name : listing.executables) {
+			m_executables.insert(name);
+		}
+		listings.insert(dirPath, listing);
+	}
+
+	if (persist && listings != cached) {
+		writeCache(listings);
+	}
+	qCDebug(sdaLog) << "ExecutableIndex:" << m_executables.size() << "executables in" << listings.size()
+			<< "directories";
+}
+
+void ExecutableIndex::addDirectories(const QStringList &dirs)
+{
+	for (const QString &dirPath : dirs) {
+		if (m_dirs.contains(dirPath)) {
+			continue;
+		}
+		m_dirs.insert(dirPath);
+		const DirectoryListing listing = listDirectory(dirPath, m_root, DirectoryListing());
+		for (const QByteArray &name : listing.executables) {
+			m_executables.insert(name);
+		}
+	}
+}
+
+// The listing of a directory, or cached if its mtime still matches; a zero mtime if it doesn't exist
+ExecutableIndex::DirectoryListing ExecutableIndex::listDirectory(const QString &dirPath, const QString &root,
+								 const DirectoryListing &cached)
+{
+	// Below a root the directory itself may be a link, e.g. /bin -> /usr/bin
+	const QString realDirPath = root.isEmpty() ? dirPath : resolveBelowRoot(root, dirPath.mid(root.size()));
+	const QFileInfo dirInfo(realDirPath);
+	RuntimeStats::add(RuntimeStats::DirectoriesStatted);
+	if (!dirInfo.isDir()) {
+		return DirectoryListing();
+	}
+
+	// Installing or removing a program changes the directory's mtime
+	const qint64 mtime = dirInfo.lastModified().toMSecsSinceEpoch();
+	if (cached.mtime == mtime) {
+		return cached;
+	}
+	DirectoryListing listing;
+	listing.mtime = mtime;
+	if (root.isEmpty()) {
+		const QStringList names = QDir(realDirPath).entryList(QDir::Files | QDir::Executable);
+		listing.executables.reserve(names.size());
+		for (const QString &name : names) {
+			listing.executables.append(QFile::encodeName(name));
+		}
+	} else {
+		// QDir would follow links out of the root, so those are resolved inside it one by one
+		const QFileInfoList entries = QDir(realDirPath).entryInfoList(QDir::Files | QDir::System);
+		for (const QFileInfo &entry : entries) {
+			const QFileInfo program = entry.isSymLink()
+				? QFileInfo(resolveBelowRoot(root, realDirPath.mid(root.size()) + '/' + entry.fileName()))
+				: entry;
+			if (program.isFile() && program.isExecutable()) {
+				listing.executables.append(QFile::encodeName(entry.fileName()));
+			}
+		}
+	}
+	qCDebug(sdaLog) << "ExecutableIndex: Listed" << dirPath;
+	return listing;
+}
+
+bool ExecutableIndex::contains(QByteArrayView program) const
+{
+	if (!m_loaded || program.isEmpty()) {
+		return true;
+	}
+	if (program.startsWith('/')) {
+		const QString path = QFile::decodeName(program.toByteArray());
+		const QFileInfo info(m_root.isEmpty() ? path : resolveBelowRoot(m_root, path));
+		return info.isFile() && info.isExecutable();
+	}
+	// Relative paths other than bare names depend on the working directory, don't judge them
+	if (program.contains('/')) {
+		return true;
+	}
+	return m_executables.contains(QByteArray::fromRawData(program.data(), program.size()));
+}
+
+QByteArrayView ExecutableIndex::execProgram(QByteArrayView exec)
+{
+	exec = exec.trimmed();
+	if (exec.startsWith('"')) {
+		const qsizetype end = exec.indexOf('"', 1);
+		const QByteArrayView quoted = exec.sliced(1, (end == -1 ? exec.size() : end) - 1);
+		return end == -1 || quoted.contains('\\') ? QByteArrayView() : quoted;
+	}
+	qsizetype end = 0;
+	while (end < exec.size() && exec[end] != ' ' && exec[end] != '\t') {
+		end++;
+	}
+	const QByteArrayView program = exec.first(end);
+	return program.contains('\\') ? QByteArrayView() : program;
+}
+
+QString ExecutableIndex::cachePath()
+{
+	return QDir(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation))
+		.absoluteFilePath("sda-qt6/path-executables.cache");
+}
+
+QHash<QString, ExecutableIndex::DirectoryListing> ExecutableIndex::readCache()
+{
+	QHash<QString, DirectoryListing> listings;
+	QFile file(cachePath());
+	if (!file.open(QIODevice::ReadOnly)) {
+		return listings;
+	}
+
+	QDataStream in(&file);
+	quint32 version = 0;
+	in >> version;
+	if (version != EXECUTABLE_CACHE_VERSION) {
+		return listings;
+	}
+
+	quint32 count = 0;
+	in >> count;
+	for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+		QString path;
+		DirectoryListing listing;
+		in >> path >> listing.mtime >> listing.executables;
+		listings.insert(path, listing);
+	}
+
+	if (in.status() != QDataStream::Ok) {
+		qCWarning(sdaLog) << "ExecutableIndex: Ignoring corrupt cache" << file.fileName();
+		listings.clear();
+	}
+	return listings;
+}
+
+void ExecutableIndex::writeCache(const QHash<QString, DirectoryListing> &listings)
+{
+	const QString path = cachePath();
+	QDir().mkpath(QFileInfo(path).absolutePath());
+
+	QSaveFile file(path);
+	if (!file.open(QIODevice::WriteOnly)) {
+		qCWarning(sdaLog) << "ExecutableIndex: Failed to write" << path << file.errorString();
+		return;
+	}
+
+	QDataStream out(&file);
+	out << EXECUTABLE_CACHE_VERSION << quint32(listings.size());
+	for (auto it = listings.begin(); it != listings.end(); ++it) {
+		out << it.key() << it->mtime << it->executables;
+	}
+	file.commit();
+}
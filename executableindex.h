@@ -0,0 +1,76 @@
+#pragma once
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+
+/**
+ * @brief The executables in $PATH, for checking TryExec and Exec without a stat per entry.
+ *
+ * Each directory is listed once. Listings are kept in the user cache directory keyed by
+ * directory mtime, so an unchanged $PATH costs one stat per directory on later runs.
+ */
+class ExecutableIndex {
+public:
+	/**
+	 * @brief List @p dirs, highest priority first.
+	 * @param root Prefix for absolute program paths, empty for this system
+	 * @param persist Whether to cache the listings, only worth it for the running user's $PATH
+	 */
+	void load(const QStringList &dirs, const QString &root, bool persist);
+
+	/**
+	 * @brief Add the executables of @p dirs that aren't indexed yet, without caching them.
+	 *
+	 * Lets a copy of a shared system index take one user's own bin directories as well.
+	 */
+	void addDirectories(const QStringList &dirs);
+
+	/**
+	 * @brief Whether a program named in TryExec or Exec exists and is executable.
+	 *
+	 * Bare names are looked up in the listings, absolute paths are stat'ed below the root,
+	 * with symlinks resolved inside it.
+	 * Always true before load(), so nothing is hidden by accident.
+	 */
+	bool contains(QByteArrayView program) const;
+
+	/**
+	 * @brief The program of an Exec value, with the quoting of the Desktop Entry specification.
+	 *
+	 * Empty if there is none or it uses escapes, which callers treat as installed.
+	 */
+	static QByteArrayView execProgram(QByteArrayView exec);
+
+	qsizetype size() const
+	{
+		return m_executables.size();
+	}
+
+private:
+	struct DirectoryListing {
+		qint64 mtime = 0;
+		QList<QByteArray> executables;
+
+		bool operator==(const DirectoryListing &other) const
+		{
+			return mtime == other.mtime && executables == other.executables;
+		}
+	};
+
+	static DirectoryListing listDirectory(const QString &dirPath, const QString &root, const DirectoryListing &cached);
+	static QString resolveBelowRoot(const QString &root, const QString &path);
+	static QString cachePath();
+	static QHash<QString, DirectoryListing> readCache();
+	static void writeCache(const QHash<QString, DirectoryListing> &listings);
+
+	// Encoded file names, compared without converting each program to a QString
+	QSet<QByteArray> m_executables;
+	QSet<QString> m_dirs;
+	QString m_root;
+	bool m_loaded = false;
+};
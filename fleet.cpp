@@ -0,0 +1,198 @@
+#include "fleet.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QThreadPool>
+#include <algorithm>
+#include <cstdio>
+#include <sys/fsuid.h>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+/**
+ * File system identity of the home's owner on the current thread, for as long as it lives.
+ *
+ * As root, writes into a user's home go through paths the user controls; a symlinked
+ * ~/.config must not let them make root write (or own) files elsewhere. With the user's
+ * fsuid/fsgid the kernel checks permissions as for the user, and new files are theirs.
+ * setfsuid() only affects the calling thread, so pool threads don't interfere.
+ */
+class HomeOwnerIdentity {
+public:
+	explicit HomeOwnerIdentity(const QString &home)
+	{
+		if (geteuid() != 0) {
+			m_ok = true;
+			return;
+		}
+		const QFileInfo homeInfo(home);
+		const uid_t uid = homeInfo.ownerId();
+		const gid_t gid = homeInfo.groupId();
+		m_previousGid = setfsgid(gid);
+		m_previousUid = setfsuid(uid);
+		m_switched = true;
+		// Both return the previous value even on failure, calling again returns the current one
+		m_ok = uid_t(setfsuid(uid)) == uid && gid_t(setfsgid(gid)) == gid;
+	}
+	~HomeOwnerIdentity()
+	{
+		if (m_switched) {
+			setfsuid(m_previousUid);
+			setfsgid(m_previousGid);
+		}
+	}
+	HomeOwnerIdentity(const HomeOwnerIdentity &) = delete;
+	HomeOwnerIdentity &operator=(const HomeOwnerIdentity &) = delete;
+
+	bool isOk() const
+	{
+		return m_ok;
+	}
+
+private:
+	bool m_switched = false;
+	bool m_ok = false;
+	uid_t m_previousUid = 0;
+	gid_t m_previousGid = 0;
+};
+}
+
+FleetRunner::FleetRunner(bool verbose)
+	: m_environment(XdgEnvironment::current()), m_system(m_environment.systemOnly()), m_verbose(verbose)
+{
+	m_system.loadApplications(verbose);
+	m_system.loadAllConfigs(verbose);
+	for (const MimeAppsList &list : m_system.getConfigFiles()) {
+		m_systemFiles.insert(list.path, list);
+	}
+}
+
+QStringList FleetRunner::readHomeList(const QString &path)
+{
+	QFile file;
+	bool opened = false;
+	if (path == "-") {
+		opened = file.open(stdin, QIODevice::ReadOnly | QIODevice::Text);
+	} else {
+		file.setFileName(path);
+		opened = file.open(QIODevice::ReadOnly | QIODevice::Text);
+	}
+	if (!opened) {
+		qCWarning(sdaLog) << "FleetRunner: Could not open" << path << file.errorString();
+		return {};
+	}
+
+	QStringList homes;
+	QTextStream in(&file);
+	while (!in.atEnd()) {
+		const QString line = in.readLine().trimmed();
+		if (!line.isEmpty() && !line.startsWith('#')) {
+			homes.append(line);
+		}
+	}
+	return homes;
+}
+
+int FleetRunner::run(const QStringList &homes, const QHash<QString, QString> &defaults) const
+{
+	// Each slot is written by exactly one task, so no locking is needed
+	std::vector<HomeReport> reports(homes.size());
+	QThreadPool pool;
+	for (qsizetype i = 0; i < homes.size(); i++) {
+		pool.start([this, &homes, &defaults, &reports, i]() {
+			reports[i] = processHome(homes[i], defaults);
+		});
+	}
+	pool.waitForDone();
+
+	int ret = 0;
+	for (qsizetype i = 0; i < homes.size(); i++) {
+		printf("%s:\n", qPrintable(homes[i]));
+		for (const QString &line : std::as_const(reports[i].lines)) {
+			printf("  %s\n", qPrintable(line));
+		}
+		if (reports[i].failed) {
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
+FleetRunner::HomeReport FleetRunner::processHome(const QString &home, const QHash<QString, QString> &defaults) const
+{
+	HomeReport report;
+	if (!QFileInfo(home).isDir()) {
+		report.lines.append("error: not a directory");
+		report.failed = true;
+		return report;
+	}
+
+	XdgMimeApps xdgMimeApps(m_environment.forHome(home));
+	xdgMimeApps.inheritApplications(m_system, m_verbose);
+	xdgMimeApps.loadAllConfigs(m_verbose, m_systemFiles);
+
+	QStringList requested = defaults.keys();
+	requested.sort();
+	QHash<QString, QString> changes;
+	for (const QString &name : std::as_const(requested)) {
+		const QString desktopId = defaults.value(name);
+		const QString mimeType = xdgMimeApps.normalizeMimeType(name);
+		if (mimeType.isEmpty()) {
+			report.lines.append(QString("skipped %1: unknown MIME type").arg(name));
+			continue;
+		}
+		if (!xdgMimeApps.hasDesktopId(desktopId)) {
+			report.lines.append(QString("skipped %1=%2: not installed").arg(mimeType, desktopId));
+			continue;
+		}
+		const QString current = xdgMimeApps.getDefaultApp(mimeType);
+		if (current == desktopId) {
+			report.lines.append(QString("unchanged %1=%2").arg(mimeType, desktopId));
+			continue;
+		}
+		changes.insert(mimeType, desktopId);
+		report.lines.append(
+			QString("set %1=%2 (was %3)")
+				.arg(mimeType, desktopId,
+				     current.isEmpty() ? QString("none")
+						       : current + " from " + xdgMimeApps.getDefaultSource(mimeType)));
+	}
+
+	// All changes for a user go into one atomic rewrite of their mimeapps.list
+	const QString userConfig = xdgMimeApps.environment().userMimeAppsListPath();
+	if (!changes.isEmpty()) {
+		const HomeOwnerIdentity identity(home);
+		if (!identity.isOk()) {
+			report.lines.append(QString("error: could not switch to the owner of %1").arg(home));
+			report.failed = true;
+		} else if (!xdgMimeApps.setDefaults(changes)) {
+			report.lines.append(QString("error: could not write %1").arg(userConfig));
+			report.failed = true;
+		}
+	}
+
+	// Defaults in the user's own file whose applications are all gone
+	int userDefaults = 0;
+	for (const MimeAppsList &list : xdgMimeApps.getConfigFiles()) {
+		if (list.path != userConfig) {
+			continue;
+		}
+		QStringList mimeTypes = list.defaults.keys();
+		mimeTypes.sort();
+		userDefaults = mimeTypes.size();
+		for (const QString &mimeType : std::as_const(mimeTypes)) {
+			const QStringList desktopIds = list.defaults.value(mimeType);
+			if (changes.contains(mimeType) ||
+			    std::any_of(desktopIds.begin(), desktopIds.end(),
+					[&](const QString &desktopId) { return xdgMimeApps.hasDesktopId(desktopId); })) {
+				continue;
+			}
+			report.lines.append(QString("stale %1=%2").arg(mimeType, desktopIds.join(';')));
+		}
+	}
+
+	report.lines.append(QString("%1 user defaults, %2 changed").arg(userDefaults).arg(changes.size()));
+	return report;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <QHash>
+#include <QString>
+#include <QStringList>
+#include "xdgmimeapps.h"
+
+/**
+ * @brief Audits or applies associations for many home directories at once.
+ *
+ * The system applications and system mimeapps.list files are loaded once and
+ * shared; each home then only costs its own ~/.config and ~/.local/share files.
+ * Homes are processed on the global thread pool, the report keeps input order.
+ *
+ * For every home the report lists the requested defaults that were set (with
+ * the default and file they replace), requests that were skipped because the
+ * desktop ID is not installed for that user, and stale entries in the user's
+ * mimeapps.list pointing at applications that no longer exist.
+ */
+class FleetRunner {
+public:
+	explicit FleetRunner(bool verbose);
+
+	/**
+	 * @brief Process all homes and print the report to stdout.
+	 * @param defaults MIME type -> desktop ID to set, empty to only audit
+	 * @return 0 if every home was processed, 1 otherwise
+	 */
+	int run(const QStringList &homes, const QHash<QString, QString> &defaults) const;
+
+	/**
+	 * @brief Read home directories from a file ("-" for stdin), one per line.
+	 */
+	static QStringList readHomeList(const QString &path);
+
+private:
+	struct HomeReport {
+		QStringList lines;
+		bool failed = false;
+	};
+
+	HomeReport processHome(const QString &home, const QHash<QString, QString> &defaults) const;
+
+	XdgEnvironment m_environment;
+	XdgMimeApps m_system;
+	// System mimeapps.list files are the same for every user, parse them once
+	QHash<QString, MimeAppsList> m_systemFiles;
+	bool m_verbose;
+};
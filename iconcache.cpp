@@ -0,0 +1,186 @@
+#include "iconcache.h"
+#include "runtimestats.h"
+#include <QApplication>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QLoggingCategory>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QStyle>
+
+Q_DECLARE_LOGGING_CATEGORY(sdaLog)
+
+IconCache::IconCache()
+{
+	m_pixmaps.setMaxCost(DEFAULT_MEMORY_LIMIT);
+}
+
+void IconCache::setMemoryLimit(qint64 bytes)
+{
+	m_pixmaps.setMaxCost(bytes);
+}
+
+void IconCache::setTargetSize(const QSize &size, qreal devicePixelRatio)
+{
+	m_size = size;
+	m_devicePixelRatio = devicePixelRatio;
+}
+
+QIcon IconCache::icon(const QString &path)
+{
+	if (path.isEmpty()) {
+		return QIcon();
+	}
+	const QPixmap rendered = pixmap(path);
+	// Fall back to letting QIcon load the file itself if we couldn't render it
+	return rendered.isNull() ? QIcon(path) : QIcon(rendered);
+}
+
+bool IconCache::contains(const QString &path) const
+{
+	const auto version = m_sourceVersions.constFind(path);
+	return version != m_sourceVersions.constEnd() && m_pixmaps.contains(memoryKey(path, *version));
+}
+
+QPixmap IconCache::pixmap(const QString &path)
+{
+	auto version = m_sourceVersions.constFind(path);
+	if (version == m_sourceVersions.constEnd()) {
+		// A replaced icon may well be older than the cached rendering, so any change counts
+		const QFileInfo info(path);
+		version = m_sourceVersions.insert(
+			path, QStringLiteral("%1-%2").arg(info.size()).arg(info.lastModified().toMSecsSinceEpoch()));
+	}
+
+	const QString key = memoryKey(path, *version);
+	if (const QPixmap *cached = m_pixmaps.object(key)) {
+		RuntimeStats::add(RuntimeStats::IconCacheHits);
+		return *cached;
+	}
+
+	QPixmap pixmap;
+	const QString diskPath = diskCachePath(path, *version);
+	const QFileInfo diskInfo(diskPath);
+	if (diskInfo.exists() && pixmap.load(diskPath, "PNG")) {
+		RuntimeStats::add(RuntimeStats::IconCacheHits);
+		pixmap.setDevicePixelRatio(m_devicePixelRatio);
+		// The mtime says when the rendering was last used, which is what pruning goes by
+		QFile file(diskPath);
+		if (file.open(QIODevice::ReadOnly)) {
+			file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+		}
+	} else {
+		pixmap = QIcon(path).pixmap(m_size, m_devicePixelRatio);
+		RuntimeStats::add(RuntimeStats::IconsCreated);
+		if (pixmap.isNull()) {
+			return pixmap;
+		}
+
+		pruneDiskCache();
+		QDir().mkpath(diskInfo.absolutePath());
+		QSaveFile file(diskPath);
+		if (file.open(QIODevice::WriteOnly) && pixmap.save(&file, "PNG")) {
+			file.commit();
+		} else {
+			qCDebug(sdaLog) << "IconCache: Failed to write" << diskPath;
+		}
+	}
+
+	const qint64 bytes = qint64(pixmap.width()) * pixmap.height() * pixmap.depth() / 8;
+	m_pixmaps.insert(key, new QPixmap(pixmap), bytes);
+	return pixmap;
+}
+
+QString IconCache::memoryKey(const QString &path, const QString &version) const
+{
+	// Like diskCachePath(), the path goes into the same arg() call as the rest
+	return QStringLiteral("%1:%2:%3x%4@%5")
+		.arg(path, version, QString::number(m_size.width()), QString::number(m_size.height()),
+		     QString::number(m_devicePixelRatio));
+}
+
+// Named after the source's version too, so a changed icon gets a new file rather than a stale hit
+QString IconCache::diskCachePath(const QString &path, const QString &version) const
+{
+	// One multi-argument arg(), so a "%1" in a path can't be substituted by the later arguments
+	const QByteArray id = QStringLiteral("%1:%2:%3x%4@%5")
+				      .arg(path, version, QString::number(m_size.width()), QString::number(m_size.height()),
+					   QString::number(m_devicePixelRatio))
+				      .toUtf8();
+	const QString name = QString::fromLatin1(QCryptographicHash::hash(id, QCryptographicHash::Sha1).toHex());
+	return diskCacheDir() + '/' + name + ".png";
+}
+
+QString IconCache::diskCacheDir()
+{
+	return QDir(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation))
+		.absoluteFilePath("sda-qt6/icons");
+}
+
+// Bounds the disk cache by age and count, at most once per session before the first write.
+// Hits refresh a file's mtime, so only renderings unused for a while (or of since changed
+// sources) age out; pruned icons that are still in use are simply rendered again.
+void IconCache::pruneDiskCache()
+{
+	static const qint64 MAX_AGE_DAYS = 30;
+	static const qsizetype MAX_ENTRIES = 4096;
+
+	if (m_diskCachePruned) {
+		return;
+	}
+	m_diskCachePruned = true;
+
+	QDir dir(diskCacheDir());
+	QFileInfoList entries = dir.entryInfoList({ "*.png" }, QDir::Files, QDir::Time);
+	const QDateTime oldest = QDateTime::currentDateTime().addDays(-MAX_AGE_DAYS);
+	int removed = 0;
+	// Sorted newest first, so everything past the limit or the age cut-off goes
+	for (qsizetype i = 0; i < entries.size(); i++) {
+		if (i >= MAX_ENTRIES || entries[i].lastModified() < oldest) {
+			removed += QFile::remove(entries[i].filePath()) ? 1 : 0;
+		}
+	}
+	if (removed > 0) {
+		qCDebug(sdaLog) << "IconCache: Pruned" << removed << "of" << entries.size() << "cached icons";
+	}
+}
+
+void IconDelegate::initStyleOption(QStyleOptionViewItem *option, const QModelIndex &index) const
+{
+	QStyledItemDelegate::initStyleOption(option, index);
+	if (option->features & QStyleOptionViewItem::HasDecoration) {
+		return;
+	}
+
+	const QString path = index.data(PathRole).toString();
+	QIcon icon;
+	if (!path.isEmpty()) {
+		icon = m_cache->icon(path);
+	}
+	if (icon.isNull()) {
+		const QString themeName = index.data(ThemeNameRole).toString();
+		if (themeName.isEmpty()) {
+			return;
+		}
+		icon = QIcon::fromTheme(themeName);
+	}
+	option->features |= QStyleOptionViewItem::HasDecoration;
+	option->icon = icon;
+	option->decorationSize = icon.actualSize(option->decorationSize);
+}
+
+// Layout only needs the decoration's size, fetching the icon here would decode every row
+QSize IconDelegate::sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const
+{
+	QStyleOptionViewItem opt = option;
+	QStyledItemDelegate::initStyleOption(&opt, index);
+	if (!index.data(PathRole).toString().isEmpty() || !index.data(ThemeNameRole).toString().isEmpty()) {
+		opt.features |= QStyleOptionViewItem::HasDecoration;
+	}
+	const QWidget *widget = opt.widget;
+	const QStyle *style = widget ? widget->style() : QApplication::style();
+	return style->sizeFromContents(QStyle::CT_ItemViewItem, &opt, QSize(), widget);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <QCache>
+#include <QHash>
+#include <QIcon>
+#include <QPixmap>
+#include <QSize>
+#include <QString>
+#include <QStyledItemDelegate>
+
+/**
+ * @brief Icons pre-rendered at the list's icon size and device pixel ratio.
+ *
+ * Rendered pixmaps are kept in a least recently used cache with a byte budget for
+ * the session and as PNGs in the user cache directory across runs, keyed by source
+ * path, size and mtime. Repainting a list then draws a ready-made pixmap instead of
+ * re-reading and rendering an SVG, and memory stays bounded however many icons
+ * have been shown. Files on disk are pruned by time since last use and count.
+ */
+class IconCache {
+public:
+	// Roughly a thousand list icons at 22x22 and a device pixel ratio of 2
+	static const qint64 DEFAULT_MEMORY_LIMIT = 8 * 1024 * 1024;
+
+	IconCache();
+
+	/**
+	 * @brief Set the size icons are rendered at. Cached pixmaps of other sizes are not reused.
+	 */
+	void setTargetSize(const QSize &size, qreal devicePixelRatio);
+
+	/**
+	 * @brief Set how many bytes of decoded pixmaps are kept, evicting the least recently used.
+	 */
+	void setMemoryLimit(qint64 bytes);
+	qint64 memoryLimit() const
+	{
+		return m_pixmaps.maxCost();
+	}
+	qint64 memoryUsed() const
+	{
+		return m_pixmaps.totalCost();
+	}
+	qsizetype count() const
+	{
+		return m_pixmaps.count();
+	}
+
+	/**
+	 * @brief Icon for an image file, or a null icon if @p path is empty.
+	 *
+	 * The icon shares the cached pixmap; holding on to it keeps the pixmap alive past eviction.
+	 */
+	QIcon icon(const QString &path);
+	bool contains(const QString &path) const;
+
+private:
+	QPixmap pixmap(const QString &path);
+	QString memoryKey(const QString &path, const QString &version) const;
+	QString diskCachePath(const QString &path, const QString &version) const;
+	static QString diskCacheDir();
+	void pruneDiskCache();
+
+	QSize m_size = QSize(16, 16);
+	qreal m_devicePixelRatio = 1.0;
+	// Source file size and mtime, so each icon file is only stat'ed once per session
+	QHash<QString, QString> m_sourceVersions;
+	// Costs are the pixmaps' sizes in bytes
+	QCache<QString, QPixmap> m_pixmaps;
+	bool m_diskCachePruned = false;
+};
+
+/**
+ * @brief Draws list icons from an IconCache when rows are painted.
+ *
+ * Items carry the icon file in PathRole, or a theme icon name in ThemeNameRole, instead
+ * of a QIcon. Only the rows being painted hold decoded pixmaps, and scrolled away rows
+ * give theirs up as the cache evicts them.
+ */
+class IconDelegate : public QStyledItemDelegate {
+public:
+	enum Role { PathRole = Qt::UserRole + 1, ThemeNameRole };
+
+	IconDelegate(IconCache *cache, QObject *parent) : QStyledItemDelegate(parent), m_cache(cache)
+	{
+	}
+
+	QSize sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const override;
+
+protected:
+	void initStyleOption(QStyleOptionViewItem *option, const QModelIndex &index) const override;
+
+private:
+	IconCache *m_cache;
+};
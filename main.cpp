@@ -1,9 +1,192 @@
+#include "associationserver.h"
+#include "batchresolver.h"
+#include "fleet.h"
 #include "selectdefaultapplication.h"
+#include "runtimestats.h"
 #include <QApplication>
 #include <QCoreApplication>
 #include <QCommandLineParser>
+#include <QFile>
 #include <QLoggingCategory>
+#include <QScopeGuard>
 #include <QString>
+#include <QThread>
+#include <algorithm>
+
+// Prints the MIME types, default and candidate handlers for each file name or extension
+static int printHandlers(const QStringList &fileNames, bool verbose)
+{
+	XdgMimeApps xdgMimeApps;
+	xdgMimeApps.loadApplications(verbose);
+	xdgMimeApps.loadAllConfigs(verbose);
+	const auto &apps = xdgMimeApps.getApps();
+
+	int ret = 0;
+	for (const QString &fileName : fileNames) {
+		const QStringList mimeTypes = xdgMimeApps.mimeTypesForFileName(fileName);
+		if (mimeTypes.isEmpty()) {
+			printf("%s: unknown file type\n", qPrintable(fileName));
+			ret = 1;
+			continue;
+		}
+		for (const QString &mimeType : mimeTypes) {
+			printf("%s: %s\n", qPrintable(fileName), qPrintable(mimeType));
+			const QString defaultApp = xdgMimeApps.getDefaultApp(mimeType);
+			printf("  default: %s\n", defaultApp.isEmpty() ? "(none)" : qPrintable(defaultApp));
+			for (const QString &appName : xdgMimeApps.getApplicationsForMimeType(mimeType)) {
+				printf("  handler: %s (%s)\n", qPrintable(appName),
+				       qPrintable(apps.value(appName).value(mimeType)));
+			}
+		}
+	}
+	return ret;
+}
+
+// Reports dead and redundant entries in the user's mimeapps.list, rewriting it if asked to
+static int printCompaction(bool write, bool verbose)
+{
+	XdgMimeApps xdgMimeApps;
+	xdgMimeApps.loadApplications(verbose);
+	const XdgMimeApps::CompactionReport report = xdgMimeApps.compactUserConfig(write);
+
+	for (const QString &problem : report.problems) {
+		printf("%s\n", qPrintable(problem));
+	}
+	const QString filePath = xdgMimeApps.environment().userMimeAppsListPath();
+	if (report.failed) {
+		fprintf(stderr, "Could not write %s\n", qPrintable(filePath));
+		return 2;
+	}
+	if (report.problems.isEmpty()) {
+		printf("%s is already compact\n", qPrintable(filePath));
+		return 0;
+	}
+	printf("%s: %d lines, %d after compaction%s\n", qPrintable(filePath), report.linesBefore, report.linesAfter,
+	       report.written ? " (rewritten)" : "");
+	return report.written ? 0 : 1;
+}
+
+// Prints the MIME types whose effective handler differs between two environments
+static int printDiff(const XdgEnvironment &left, const XdgEnvironment &right, bool verbose)
+{
+	XdgMimeApps leftApps(left);
+	XdgMimeApps rightApps(right);
+	// The two sides share nothing, load them side by side
+	QThread *leftLoader = QThread::create([&leftApps, verbose]() {
+		leftApps.loadApplications(verbose);
+		leftApps.loadAllConfigs(verbose);
+	});
+	leftLoader->start();
+	rightApps.loadApplications(verbose);
+	rightApps.loadAllConfigs(verbose);
+	leftLoader->wait();
+	delete leftLoader;
+
+	const QHash<QString, XdgMimeApps::EffectiveHandler> leftHandlers = leftApps.resolveEffectiveHandlers();
+	const QHash<QString, XdgMimeApps::EffectiveHandler> rightHandlers = rightApps.resolveEffectiveHandlers();
+
+	QStringList mimeTypes = leftHandlers.keys();
+	for (auto it = rightHandlers.keyBegin(); it != rightHandlers.keyEnd(); ++it) {
+		if (!leftHandlers.contains(*it)) {
+			mimeTypes.append(*it);
+		}
+	}
+	mimeTypes.sort();
+
+	const auto describe = [](const XdgMimeApps::EffectiveHandler &handler) {
+		if (handler.desktopId.isEmpty()) {
+			return QString("(none)");
+		}
+		return handler.desktopId + " [" + (handler.source.isEmpty() ? QString("MimeType=") : handler.source) + ']';
+	};
+
+	int differences = 0;
+	for (const QString &mimeType : std::as_const(mimeTypes)) {
+		const XdgMimeApps::EffectiveHandler leftHandler = leftHandlers.value(mimeType);
+		const XdgMimeApps::EffectiveHandler rightHandler = rightHandlers.value(mimeType);
+		if (leftHandler.desktopId == rightHandler.desktopId) {
+			continue;
+		}
+		differences++;
+		printf("%s\n  - %s\n  + %s\n", qPrintable(mimeType), qPrintable(describe(leftHandler)),
+		       qPrintable(describe(rightHandler)));
+	}
+	printf("%d of %lld MIME types differ\n", differences, static_cast<long long>(mimeTypes.size()));
+	return differences > 0 ? 1 : 0;
+}
+
+/**
+ * Prints the MIME types whose effective handler differs between desktop sessions.
+ * Applications and every mimeapps.list are loaded once; each desktop only resolves its own
+ * precedence chain over those, with its *-mimeapps.list layers in front of the generic ones.
+ */
+static int printDesktops(const QStringList &sessions, bool verbose)
+{
+	// A session may name several desktops, like XDG_CURRENT_DESKTOP: "ubuntu:GNOME"
+	QList<QStringList> sessionDesktops;
+	QStringList allDesktops;
+	for (const QString &session : sessions) {
+		QStringList desktops;
+		for (const QString &desktop : session.split(':', Qt::SkipEmptyParts)) {
+			desktops.append(desktop.trimmed().toLower());
+		}
+		sessionDesktops.append(desktops);
+		allDesktops.append(desktops);
+	}
+	allDesktops.removeDuplicates();
+
+	// Loaded for no desktop in particular, each session applies OnlyShowIn/NotShowIn itself
+	XdgEnvironment environment = XdgEnvironment::current();
+	environment.desktops.clear();
+	XdgMimeApps xdgMimeApps(environment);
+	xdgMimeApps.loadApplications(verbose);
+	xdgMimeApps.loadAllConfigs(verbose);
+	QHash<QString, MimeAppsList> parsedFiles;
+	for (const MimeAppsList &list : xdgMimeApps.getConfigFiles()) {
+		parsedFiles.insert(list.path, list);
+	}
+	// Every desktop-specific file once, a desktop named by several sessions isn't parsed again
+	for (const MimeAppsList &list : xdgMimeApps.forDesktops(allDesktops, verbose, parsedFiles).getConfigFiles()) {
+		parsedFiles.insert(list.path, list);
+	}
+
+	QList<QHash<QString, XdgMimeApps::EffectiveHandler> > handlers;
+	QSet<QString> mimeTypeSet;
+	for (const QStringList &desktops : std::as_const(sessionDesktops)) {
+		handlers.append(xdgMimeApps.forDesktops(desktops, verbose, parsedFiles).resolveEffectiveHandlers());
+		for (auto it = handlers.last().keyBegin(); it != handlers.last().keyEnd(); ++it) {
+			mimeTypeSet.insert(*it);
+		}
+	}
+	QStringList mimeTypes = mimeTypeSet.values();
+	mimeTypes.sort();
+
+	const auto describe = [](const XdgMimeApps::EffectiveHandler &handler) {
+		if (handler.desktopId.isEmpty()) {
+			return QString("(none)");
+		}
+		return handler.desktopId + " [" + (handler.source.isEmpty() ? QString("MimeType=") : handler.source) + ']';
+	};
+
+	int differences = 0;
+	for (const QString &mimeType : std::as_const(mimeTypes)) {
+		const QString first = handlers.first().value(mimeType).desktopId;
+		const bool same = std::all_of(handlers.begin(), handlers.end(), [&](const auto &sessionHandlers) {
+			return sessionHandlers.value(mimeType).desktopId == first;
+		});
+		if (same) {
+			continue;
+		}
+		differences++;
+		printf("%s\n", qPrintable(mimeType));
+		for (qsizetype i = 0; i < sessions.size(); i++) {
+			printf("  %s: %s\n", qPrintable(sessions[i]), qPrintable(describe(handlers[i].value(mimeType))));
+		}
+	}
+	printf("%d of %lld MIME types differ between %lld desktops\n", differences,
+	       static_cast<long long>(mimeTypes.size()), static_cast<long long>(sessions.size()));
+	return differences > 0 ? 1 : 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -11,7 +194,9 @@ int main(int argc, char *argv[])
 	bool isGui = true;
 	for (int i = 1; i < argc; ++i) {
 		QString arg = QString::fromLocal8Bit(argv[i]);
-		if (arg == "-h" || arg == "--help" || arg == "--help-all" || arg == "-v" || arg == "--version") {
+		if (arg == "-h" || arg == "--help" || arg == "--help-all" || arg == "-v" || arg == "--version" ||
+		    arg == "--daemon" || arg == "--lookup" || arg == "--fleet" || arg == "--diff" ||
+		    arg == "--diff-homes" || arg == "--desktops" || arg == "--resolve" || arg == "--check" || arg == "--compact") {
 			isGui = false;
 			break;
 		}
@@ -33,6 +218,61 @@ int main(int argc, char *argv[])
 						   "main",
 						   "Print verbose information about how the desktop files are parsed"));
 		parser.addOption(verbose);
+		QCommandLineOption stats("stats", QCoreApplication::translate(
+							  "main", "Print I/O, lookup and memory statistics on exit"));
+		parser.addOption(stats);
+		QCommandLineOption daemon("daemon", QCoreApplication::translate(
+							    "main", "Run without a window and answer association queries "
+								    "over a local socket"));
+		parser.addOption(daemon);
+		QCommandLineOption socket("socket",
+					  QCoreApplication::translate("main", "Socket path for --daemon (default: %1)")
+						  .arg(AssociationServer::defaultSocketPath()),
+					  QCoreApplication::translate("main", "path"));
+		parser.addOption(socket);
+		QCommandLineOption lookup("lookup",
+					  QCoreApplication::translate(
+						  "main", "Print what opens the given file names or extensions (e.g. \"*.heic\")"));
+		parser.addOption(lookup);
+		QCommandLineOption fleet("fleet",
+					 QCoreApplication::translate("main", "Audit the home directories listed in a file (\"-\" "
+									     "for stdin, one per line)"),
+					 QCoreApplication::translate("main", "file"));
+		parser.addOption(fleet);
+		QCommandLineOption fleetSet("fleet-set",
+					    QCoreApplication::translate(
+						    "main", "Set a default for every home of --fleet, may be repeated"),
+					    QCoreApplication::translate("main", "mimetype=desktop-id"));
+		parser.addOption(fleetSet);
+		QCommandLineOption diff("diff", QCoreApplication::translate(
+							"main", "Print the MIME types whose handler differs between two "
+								"root directories, e.g. unpacked container images"));
+		parser.addOption(diff);
+		QCommandLineOption diffHomes("diff-homes",
+					     QCoreApplication::translate(
+						     "main", "Like --diff, but compare two home directories on this system"));
+		parser.addOption(diffHomes);
+		QCommandLineOption desktops("desktops",
+					    QCoreApplication::translate(
+						    "main", "Print the MIME types whose handler differs between these desktops, "
+							    "comma separated (e.g. KDE,GNOME,Hyprland)"),
+					    QCoreApplication::translate("main", "desktops"));
+		parser.addOption(desktops);
+		QCommandLineOption resolve("resolve", QCoreApplication::translate(
+							      "main", "Print the MIME type and handler of every file path or URI "
+								      "read from stdin, one per line"));
+		parser.addOption(resolve);
+		QCommandLineOption check("check", QCoreApplication::translate(
+							  "main", "Report entries in ~/.config/mimeapps.list that point at "
+								  "uninstalled applications or are duplicated"));
+		parser.addOption(check);
+		QCommandLineOption compact("compact", QCoreApplication::translate(
+							      "main", "Like --check, then rewrite the file without those entries"));
+		parser.addOption(compact);
+		parser.addPositionalArgument(
+			"files",
+			QCoreApplication::translate("main", "File names or extensions for --lookup, two directories for --diff"),
+			"[files...]");
 		parser.parse(a.arguments());
 		if (parser.isSet("help")) {
 			puts(qPrintable(parser.helpText()));
@@ -42,6 +282,93 @@ int main(int argc, char *argv[])
 			printf("%s %s\n", qPrintable(a.applicationName()), qPrintable(a.applicationVersion()));
 			return 0;
 		}
+		RuntimeStats::setEnabled(parser.isSet(stats));
+		// Printed however the mode below returns, on stderr so it can't mix with its output
+		const auto statsReport = qScopeGuard([]() {
+			if (RuntimeStats::isEnabled()) {
+				fputs(qPrintable(RuntimeStats::report({})), stderr);
+			}
+		});
+		if (parser.isSet(lookup)) {
+			if (parser.isSet(verbose)) {
+				QLoggingCategory::setFilterRules(QStringLiteral("sda.log.debug=true"));
+			}
+			return printHandlers(parser.positionalArguments(), parser.isSet(verbose));
+		}
+		if (parser.isSet(check) || parser.isSet(compact)) {
+			if (parser.isSet(verbose)) {
+				QLoggingCategory::setFilterRules(QStringLiteral("sda.log.debug=true"));
+			}
+			return printCompaction(parser.isSet(compact), parser.isSet(verbose));
+		}
+		if (parser.isSet(diff) || parser.isSet(diffHomes)) {
+			const QStringList dirs = parser.positionalArguments();
+			if (dirs.size() != 2) {
+				fputs("--diff and --diff-homes need exactly two directories\n", stderr);
+				return 2;
+			}
+			if (parser.isSet(verbose)) {
+				QLoggingCategory::setFilterRules(QStringLiteral("sda.log.debug=true"));
+			}
+			const XdgEnvironment environment = XdgEnvironment::current();
+			if (parser.isSet(diffHomes)) {
+				return printDiff(environment.forHome(dirs[0]), environment.forHome(dirs[1]),
+						 parser.isSet(verbose));
+			}
+			return printDiff(environment.forRoot(dirs[0]), environment.forRoot(dirs[1]), parser.isSet(verbose));
+		}
+		if (parser.isSet(resolve)) {
+			if (parser.isSet(verbose)) {
+				QLoggingCategory::setFilterRules(QStringLiteral("sda.log.debug=true"));
+			}
+			QFile input;
+			if (!input.open(stdin, QIODevice::ReadOnly)) {
+				fputs("Could not read stdin\n", stderr);
+				return 2;
+			}
+			const BatchResolver resolver(parser.isSet(verbose));
+			return resolver.run(input, stdout) > 0 ? 1 : 0;
+		}
+		if (parser.isSet(desktops)) {
+			const QStringList sessions = parser.value(desktops).split(',', Qt::SkipEmptyParts);
+			if (sessions.isEmpty()) {
+				fputs("--desktops needs at least one desktop name\n", stderr);
+				return 2;
+			}
+			if (parser.isSet(verbose)) {
+				QLoggingCategory::setFilterRules(QStringLiteral("sda.log.debug=true"));
+			}
+			return printDesktops(sessions, parser.isSet(verbose));
+		}
+		if (parser.isSet(fleet)) {
+			if (parser.isSet(verbose)) {
+				QLoggingCategory::setFilterRules(QStringLiteral("sda.log.debug=true"));
+			}
+			QHash<QString, QString> defaults;
+			for (const QString &assignment : parser.values(fleetSet)) {
+				const QString mimeType = assignment.section('=', 0, 0).trimmed();
+				const QString desktopId = assignment.section('=', 1).trimmed();
+				if (mimeType.isEmpty() || desktopId.isEmpty()) {
+					fprintf(stderr, "Invalid --fleet-set value: %s\n", qPrintable(assignment));
+					return 1;
+				}
+				defaults.insert(mimeType, desktopId);
+			}
+			const FleetRunner runner(parser.isSet(verbose));
+			return runner.run(FleetRunner::readHomeList(parser.value(fleet)), defaults);
+		}
+		if (parser.isSet(daemon)) {
+			if (parser.isSet(verbose)) {
+				QLoggingCategory::setFilterRules(QStringLiteral("sda.log.debug=true"));
+			}
+			AssociationServer server(parser.isSet(verbose));
+			const QString socketPath =
+				parser.isSet(socket) ? parser.value(socket) : AssociationServer::defaultSocketPath();
+			if (!server.listen(socketPath)) {
+				return 1;
+			}
+			return a.exec();
+		}
 		// Fallback if loop detected help/version but parser didn't see it (unlikely)
 		return 0;
 	}
@@ -61,14 +388,38 @@ int main(int argc, char *argv[])
 					   "main", "Print verbose information about how the desktop files are parsed"));
 
 	parser.addOption(verbose);
+	QCommandLineOption stats("stats",
+				 QCoreApplication::translate("main", "Print I/O, lookup and memory statistics on exit"));
+	parser.addOption(stats);
+	QCommandLineOption iconMemory("icon-memory",
+				      QCoreApplication::translate(
+					      "main", "Memory for decoded icons in MiB, least recently shown ones are "
+						      "dropped first (default: %1)")
+					      .arg(IconCache::DEFAULT_MEMORY_LIMIT / (1024 * 1024)),
+				      QCoreApplication::translate("main", "MiB"));
+	parser.addOption(iconMemory);
 	parser.process(a);
 
 	if (parser.isSet(verbose)) {
 		QLoggingCategory::setFilterRules(QStringLiteral("sda.log.debug=true"));
 	}
+	RuntimeStats::setEnabled(parser.isSet(stats));
 
 	SelectDefaultApplication w(nullptr, parser.isSet(verbose));
+	if (parser.isSet(iconMemory)) {
+		bool ok = false;
+		const qint64 mebibytes = parser.value(iconMemory).toLongLong(&ok);
+		if (!ok || mebibytes < 0) {
+			fprintf(stderr, "Invalid --icon-memory value: %s\n", qPrintable(parser.value(iconMemory)));
+			return 1;
+		}
+		w.setIconMemoryLimit(mebibytes * 1024 * 1024);
+	}
 	w.show();
 
-	return a.exec();
+	const int ret = a.exec();
+	if (RuntimeStats::isEnabled()) {
+		fputs(qPrintable(w.statisticsReport()), stdout);
+	}
+	return ret;
 }
@@ -0,0 +1,70 @@
+#include "mimehierarchy.h"
+#include "runtimestats.h"
+#include <QMimeType>
+#include <algorithm>
+
+void MimeHierarchy::build(const QSet<QString> &mimeTypes, const QMimeDatabase &mimeDb)
+{
+	clear();
+
+	m_names = mimeTypes.values();
+	std::sort(m_names.begin(), m_names.end());
+	m_ids.reserve(m_names.size());
+	for (int id = 0; id < m_names.size(); id++) {
+		m_ids.insert(m_names.at(id), id);
+	}
+
+	// Invert allAncestors() into per-type descendant lists. Walking the ancestors of every
+	// type already gives the transitive closure, so there is no need for a fixpoint pass.
+	QList<QList<int> > children(m_names.size());
+	for (int id = 0; id < m_names.size(); id++) {
+		const QMimeType mimetype = mimeDb.mimeTypeForName(m_names.at(id));
+		RuntimeStats::add(RuntimeStats::MimeLookups);
+		if (!mimetype.isValid()) {
+			continue;
+		}
+		const QStringList ancestors = mimetype.allAncestors();
+		for (const QString &ancestor : ancestors) {
+			if (ancestor == "application/octet-stream") {
+				continue;
+			}
+			const int ancestorId = idOf(ancestor);
+			if (ancestorId != -1 && ancestorId != id) {
+				children[ancestorId].append(id);
+			}
+		}
+	}
+
+	m_offsets.reserve(m_names.size() + 1);
+	m_offsets.append(0);
+	for (QList<int> &list : children) {
+		std::sort(list.begin(), list.end());
+		list.erase(std::unique(list.begin(), list.end()), list.end());
+		m_descendants.append(list);
+		m_offsets.append(m_descendants.size());
+	}
+	m_descendants.squeeze();
+}
+
+void MimeHierarchy::clear()
+{
+	m_names.clear();
+	m_ids.clear();
+	m_offsets.clear();
+	m_descendants.clear();
+}
+
+MimeHierarchy::Range MimeHierarchy::descendants(int id) const
+{
+	if (id < 0 || id >= m_names.size()) {
+		return {};
+	}
+	const int *data = m_descendants.constData();
+	return { data + m_offsets.at(id), data + m_offsets.at(id + 1) };
+}
+
+qint64 MimeHierarchy::estimatedBytes() const
+{
+	return RuntimeStats::heapBytes(m_names) + RuntimeStats::heapBytes(m_ids) + RuntimeStats::heapBytes(m_offsets) +
+	       RuntimeStats::heapBytes(m_descendants);
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <QHash>
+#include <QList>
+#include <QMimeDatabase>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+
+/**
+ * @brief Transitive closure of the shared-mime-info hierarchy over a set of MIME types.
+ *
+ * MIME types are interned to dense ids (assigned in name order) and the descendants of
+ * every type are kept as sorted ranges of one flat array, so walking them never allocates.
+ * E.g. text/plain -> text/x-csrc -> text/x-c++src makes text/x-c++src a descendant of text/plain.
+ */
+class MimeHierarchy {
+public:
+	// Borrowed view of a contiguous run of MIME type ids
+	struct Range {
+		const int *first = nullptr;
+		const int *last = nullptr;
+
+		const int *begin() const
+		{
+			return first;
+		}
+		const int *end() const
+		{
+			return last;
+		}
+		bool isEmpty() const
+		{
+			return first == last;
+		}
+		qsizetype size() const
+		{
+			return last - first;
+		}
+	};
+
+	/**
+	 * @brief Build the closure for the given MIME types, replacing any previous contents.
+	 *
+	 * Only types in @p mimeTypes are interned; ancestors outside of it are walked through
+	 * but not recorded.
+	 */
+	void build(const QSet<QString> &mimeTypes, const QMimeDatabase &mimeDb);
+	void clear();
+
+	int idOf(const QString &mimeType) const
+	{
+		return m_ids.value(mimeType, -1);
+	}
+	const QString &nameOf(int id) const
+	{
+		return m_names.at(id);
+	}
+	qsizetype size() const
+	{
+		return m_names.size();
+	}
+
+	/**
+	 * @brief All transitive children of a MIME type, sorted by id.
+	 */
+	Range descendants(int id) const;
+	Range descendants(const QString &mimeType) const
+	{
+		return descendants(idOf(mimeType));
+	}
+
+	// Total number of (ancestor, descendant) pairs, for diagnostics
+	qsizetype edgeCount() const
+	{
+		return m_descendants.size();
+	}
+	qint64 estimatedBytes() const;
+
+private:
+	QStringList m_names;
+	QHash<QString, int> m_ids;
+	// m_descendants[m_offsets[id] .. m_offsets[id + 1]) are the descendants of id
+	QList<int> m_offsets;
+	QList<int> m_descendants;
+};
@@ -0,0 +1,44 @@
+#include "runtimestats.h"
+#include <QLocale>
+
+QString RuntimeStats::counterName(Counter counter)
+{
+	switch (counter) {
+	case FilesOpened:
+		return QStringLiteral("Files opened");
+	case BytesRead:
+		return QStringLiteral("Bytes read");
+	case DirectoriesStatted:
+		return QStringLiteral("Directories stat'ed");
+	case MimeLookups:
+		return QStringLiteral("MIME database lookups");
+	case MimeCacheHits:
+		return QStringLiteral("MIME cache hits");
+	case ListItemsCreated:
+		return QStringLiteral("List items created");
+	case IconsCreated:
+		return QStringLiteral("Icons created");
+	case IconCacheHits:
+		return QStringLiteral("Icon cache hits");
+	case MimetypesPrefetched:
+		return QStringLiteral("MIME types prefetched");
+	case CounterCount:
+		break;
+	}
+	return QString();
+}
+
+QString RuntimeStats::report(const QList<QPair<QString, qint64> > &memory)
+{
+	const QLocale locale = QLocale::c();
+	QString text = QStringLiteral("Runtime statistics:\n");
+	for (int i = 0; i < CounterCount; i++) {
+		const Counter counter = Counter(i);
+		text += QStringLiteral("  %1 %2\n").arg(counterName(counter) + ':', -24).arg(value(counter));
+	}
+	text += QStringLiteral("Estimated memory:\n");
+	for (const auto &[label, bytes] : memory) {
+		text += QStringLiteral("  %1 %2\n").arg(label + ':', -24).arg(locale.formattedDataSize(bytes));
+	}
+	return text;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <atomic>
+
+/**
+ * @brief Process-wide counters behind the --stats report.
+ *
+ * Counting is always on (a relaxed atomic add), only the report is opt-in.
+ * When a user reports slowness, the report shows which part of their system
+ * (number of desktop files, icon theme size, MIME types...) is the cause.
+ */
+class RuntimeStats {
+public:
+	enum Counter {
+		FilesOpened,
+		BytesRead,
+		DirectoriesStatted,
+		MimeLookups,
+		MimeCacheHits,
+		ListItemsCreated,
+		IconsCreated,
+		IconCacheHits,
+		MimetypesPrefetched,
+		CounterCount
+	};
+
+	static void add(Counter counter, qint64 amount = 1)
+	{
+		s_counters[counter].fetch_add(amount, std::memory_order_relaxed);
+	}
+	static qint64 value(Counter counter)
+	{
+		return s_counters[counter].load(std::memory_order_relaxed);
+	}
+	static QString counterName(Counter counter);
+
+	static void setEnabled(bool enabled)
+	{
+		s_enabled = enabled;
+	}
+	static bool isEnabled()
+	{
+		return s_enabled;
+	}
+
+	/**
+	 * @brief Format all counters plus the given (label, estimated bytes) memory lines.
+	 */
+	static QString report(const QList<QPair<QString, qint64> > &memory);
+
+	// Rough heap usage of Qt containers, ignoring allocator overhead and implicit sharing
+	static qint64 heapBytes(const QString &string)
+	{
+		return string.isEmpty() ? 0 : qint64(string.capacity() + 1) * qint64(sizeof(QChar)) + 16;
+	}
+	template <typename T> static qint64 heapBytes(const T &)
+	{
+		return 0;
+	}
+	template <typename T> static qint64 heapBytes(const QList<T> &list)
+	{
+		qint64 bytes = qint64(list.capacity()) * qint64(sizeof(T));
+		for (const T &value : list) {
+			bytes += heapBytes(value);
+		}
+		return bytes;
+	}
+	template <typename K, typename V> static qint64 heapBytes(const QHash<K, V> &hash)
+	{
+		// Qt 6 hashes store nodes in spans with one byte of offset per bucket
+		qint64 bytes = qint64(hash.capacity()) + qint64(hash.size()) * qint64(sizeof(K) + sizeof(V));
+		for (auto it = hash.begin(); it != hash.end(); ++it) {
+			bytes += heapBytes(it.key()) + heapBytes(it.value());
+		}
+		return bytes;
+	}
+
+private:
+	static inline std::atomic<qint64> s_counters[CounterCount] = {};
+	static inline bool s_enabled = false;
+};
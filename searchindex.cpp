@@ -0,0 +1,151 @@
+#include "searchindex.h"
+#include "runtimestats.h"
+#include <QSet>
+#include <algorithm>
+
+// Scores are out of 100 per unit of field weight, an exact substring match adds the same again
+static const int FULL_MATCH_SCORE = 100;
+
+void SearchIndex::clear()
+{
+	m_documents.clear();
+	m_documentIds.clear();
+	m_postings.clear();
+}
+
+int SearchIndex::addDocument(const QString &key)
+{
+	const auto existing = m_documentIds.constFind(key);
+	if (existing != m_documentIds.constEnd()) {
+		return *existing;
+	}
+	const int document = m_documents.size();
+	m_documents.append(Document{ key, {} });
+	m_documentIds.insert(key, document);
+	return document;
+}
+
+void SearchIndex::addField(int document, const QString &text, int weight)
+{
+	const QString normalized = normalize(text);
+	if (normalized.isEmpty()) {
+		return;
+	}
+	m_documents[document].fields.append(Field{ normalized, weight });
+
+	// Pad with spaces so word starts and ends get trigrams of their own
+	const QString padded = ' ' + normalized + ' ';
+	QSet<quint64> seen;
+	for (qsizetype i = 0; i + 3 <= padded.size(); i++) {
+		const quint64 key = trigramKey(padded.constData() + i);
+		if (seen.contains(key)) {
+			continue;
+		}
+		seen.insert(key);
+		m_postings[key].append(Posting{ document, weight });
+	}
+}
+
+QString SearchIndex::normalize(const QString &text)
+{
+	return text.simplified().toCaseFolded();
+}
+
+QList<SearchIndex::Match> SearchIndex::search(const QString &query) const
+{
+	const QString normalized = normalize(query);
+	if (normalized.isEmpty()) {
+		return {};
+	}
+	if (normalized.size() < 3) {
+		return substringSearch(normalized);
+	}
+
+	QList<quint64> trigrams;
+	for (qsizetype i = 0; i + 3 <= normalized.size(); i++) {
+		const quint64 key = trigramKey(normalized.constData() + i);
+		if (!trigrams.contains(key)) {
+			trigrams.append(key);
+		}
+	}
+
+	// Per document: number of distinct query trigrams found, the best field weight they
+	// were found in, and the last trigram counted so a document isn't counted twice
+	// for one trigram when several of its fields contain it. Only documents on the
+	// visited posting lists get an entry, so a keystroke costs what those lists hold.
+	struct Candidate {
+		int hits = 0;
+		int bestWeight = 0;
+		int lastTrigram = -1;
+	};
+	QHash<int, Candidate> candidates;
+	QList<int> touched;
+	for (int t = 0; t < trigrams.size(); t++) {
+		const auto postings = m_postings.constFind(trigrams.at(t));
+		if (postings == m_postings.constEnd()) {
+			continue;
+		}
+		for (const Posting &posting : *postings) {
+			Candidate &candidate = candidates[posting.document];
+			if (candidate.hits == 0) {
+				touched.append(posting.document);
+			}
+			if (candidate.lastTrigram != t) {
+				candidate.lastTrigram = t;
+				candidate.hits++;
+			}
+			candidate.bestWeight = std::max(candidate.bestWeight, posting.weight);
+		}
+	}
+
+	const int required = (int(trigrams.size()) * 2 + 2) / 3;
+	QList<Match> matches;
+	for (const int document : std::as_const(touched)) {
+		const Candidate &candidate = candidates[document];
+		if (candidate.hits < required) {
+			continue;
+		}
+		int score = candidate.hits * FULL_MATCH_SCORE / int(trigrams.size()) * candidate.bestWeight;
+		score += substringWeight(document, normalized) * FULL_MATCH_SCORE;
+		matches.append(Match{ document, score });
+	}
+
+	std::sort(matches.begin(), matches.end(), [](const Match &a, const Match &b) { return a.score > b.score; });
+	return matches;
+}
+
+QList<SearchIndex::Match> SearchIndex::substringSearch(const QString &query) const
+{
+	QList<Match> matches;
+	for (int document = 0; document < m_documents.size(); document++) {
+		const int weight = substringWeight(document, query);
+		if (weight > 0) {
+			matches.append(Match{ document, weight * FULL_MATCH_SCORE });
+		}
+	}
+	std::sort(matches.begin(), matches.end(), [](const Match &a, const Match &b) { return a.score > b.score; });
+	return matches;
+}
+
+int SearchIndex::substringWeight(int document, const QString &query) const
+{
+	int weight = 0;
+	for (const Field &field : m_documents.at(document).fields) {
+		if (field.weight > weight && field.text.contains(query)) {
+			weight = field.weight;
+		}
+	}
+	return weight;
+}
+
+qint64 SearchIndex::estimatedBytes() const
+{
+	qint64 bytes = RuntimeStats::heapBytes(m_documentIds) + RuntimeStats::heapBytes(m_postings);
+	for (const Document &document : m_documents) {
+		bytes += sizeof(Document) + RuntimeStats::heapBytes(document.key);
+		for (const Field &field : document.fields) {
+			bytes += sizeof(Field) + RuntimeStats::heapBytes(field.text);
+		}
+	}
+	return bytes;
+}
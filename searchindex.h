@@ -0,0 +1,80 @@
+#pragma once
+
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+/**
+ * @brief Ranked fuzzy search over short texts using a trigram index.
+ *
+ * Every document has a key and any number of weighted text fields. Queries are
+ * split into trigrams and only the posting lists of those trigrams are visited,
+ * so a lookup doesn't depend on the number of documents that can't match.
+ * A document matches when it contains at least two thirds of the query's trigrams,
+ * which tolerates typos ("libreofice") and partial words.
+ */
+class SearchIndex {
+public:
+	struct Match {
+		int document;
+		int score;
+	};
+
+	void clear();
+
+	/**
+	 * @brief Add a document, or return the existing one with the same key.
+	 */
+	int addDocument(const QString &key);
+	void addField(int document, const QString &text, int weight);
+
+	int documentId(const QString &key) const
+	{
+		return m_documentIds.value(key, -1);
+	}
+	const QString &documentKey(int document) const
+	{
+		return m_documents.at(document).key;
+	}
+	qsizetype size() const
+	{
+		return m_documents.size();
+	}
+
+	/**
+	 * @brief Matching documents ordered by descending score.
+	 *
+	 * Queries shorter than a trigram fall back to a substring scan of all fields.
+	 */
+	QList<Match> search(const QString &query) const;
+
+	qint64 estimatedBytes() const;
+
+private:
+	struct Field {
+		QString text;
+		int weight;
+	};
+	struct Document {
+		QString key;
+		QList<Field> fields;
+	};
+	struct Posting {
+		int document;
+		int weight;
+	};
+
+	static QString normalize(const QString &text);
+	static quint64 trigramKey(const QChar *chars)
+	{
+		return (quint64(chars[0].unicode()) << 32) | (quint64(chars[1].unicode()) << 16) | chars[2].unicode();
+	}
+	QList<Match> substringSearch(const QString &query) const;
+	// Best weight of a field containing query as a substring, 0 if none does
+	int substringWeight(int document, const QString &query) const;
+
+	QList<Document> m_documents;
+	QHash<QString, int> m_documentIds;
+	QHash<quint64, QList<Posting> > m_postings;
+};
@@ -1,9 +1,12 @@
 #include "selectdefaultapplication.h"
+#include "runtimestats.h"
 #include <QLoggingCategory>
 #include <QCheckBox>
+#include <QCollator>
 #include <QDialog>
 #include <QDir>
 #include <QDirIterator>
+#include <QElapsedTimer>
 #include <QFile>
 #include <QGridLayout>
 #include <QGuiApplication>
@@ -11,102 +14,38 @@
 #include <QListWidget>
 #include <QMessageBox>
 #include <QPushButton>
-#include <QStandardPaths>
+#include <QStyle>
+#include <QThread>
+#include <QTimer>
 #include <QTreeWidget>
+#include <vector>
 
 SelectDefaultApplication::SelectDefaultApplication(QWidget *parent, bool isVerbose)
-	: QWidget(parent), isVerbose(isVerbose)
+	: QWidget(parent), isVerbose(isVerbose), m_xdgMimeApps(std::make_shared<XdgMimeApps>())
 {
-	m_xdgMimeApps.loadApplications(isVerbose);
-	m_xdgMimeApps.loadAllConfigs(isVerbose);
-
-	readCurrentDefaultMimetypes();
-
-	// Now that m_apps is populated, sync human-readable names with XDG defaults
-	readCurrentDefaultMimetypes();
-
-	// Preload icons up front, so it doesn't get sluggish when selecting applications
-	// supporting a lot
-	const QIcon unknownIcon = QIcon::fromTheme("unknown");
-
-	// TODO: check if QT_QPA_PLATFORMTHEME is set to plasma or sandsmark,
-	// if so just use the functioning QIcon::fromTheme()
-	// We do this manually because non-Plasma-platforms icon loading is extremely
-	// slow (I blame GTK and its crappy icon cache)
-	for (const QString &searchPath : (QIcon::themeSearchPaths() + QIcon::fallbackSearchPaths())) {
-		loadIcons(searchPath + QIcon::themeName());
-		loadIcons(searchPath);
-	}
-
-	// Set m_mimeTypeIcons[mimetypeName] to an appropriate icon
-	const auto &apps = m_xdgMimeApps.getApps();
-	const auto &appIcons = m_xdgMimeApps.getApplicationIcons();
-	for (const QHash<QString, QString> &application_associations : apps.values()) {
-		for (const QString &mimetypeName : application_associations.keys()) {
-			if (m_mimeTypeIcons.contains(mimetypeName)) {
-				continue;
-			}
-			// Here we actually want to use the real mimetype, because we need to access its iconName
-			const QMimeType mimetype = m_mimeDb.mimeTypeForName(mimetypeName);
-
-			QString iconName = mimetype.iconName();
-			QIcon icon(m_iconPaths.value(iconName));
-			if (!icon.isNull()) {
-				m_mimeTypeIcons[mimetypeName] = icon;
-				continue;
-			}
-			icon = QIcon(m_iconPaths.value(mimetype.genericIconName()));
-			if (!icon.isNull()) {
-				m_mimeTypeIcons[mimetypeName] = icon;
-				continue;
-			}
-			int split = iconName.lastIndexOf('+');
-			if (split != -1) {
-				iconName.truncate(split);
-				icon = QIcon(m_iconPaths.value(iconName));
-				if (!icon.isNull()) {
-					m_mimeTypeIcons[mimetypeName] = icon;
-					continue;
-				}
-			}
-			split = iconName.lastIndexOf('-');
-			if (split != -1) {
-				iconName.truncate(split);
-				icon = QIcon(m_iconPaths.value(iconName));
-				if (!icon.isNull()) {
-					m_mimeTypeIcons[mimetypeName] = icon;
-					continue;
-				}
-			}
-			icon = QIcon(m_iconPaths.value(mimetype.genericIconName()));
-			if (!icon.isNull()) {
-				m_mimeTypeIcons[mimetypeName] = icon;
-				continue;
-			}
-
-			m_mimeTypeIcons[mimetypeName] = unknownIcon;
-		}
-	}
-
-	// The rest of this constructor sets up the GUI
+	// The GUI is set up first and shown right away, startLoading() fills it from a background thread
 	// Left section
 	m_applicationList = new QListWidget;
+	m_applicationList->setUniformItemSizes(true);
 	m_applicationList->setSelectionMode(QAbstractItemView::SingleSelection);
-	populateApplicationList("");
-
+	// All lists share one icon size, so the icon cache renders each icon only once
+	const int iconExtent = style()->pixelMetric(QStyle::PM_ListViewIconSize, nullptr, m_applicationList);
+	const QSize iconSize(iconExtent, iconExtent);
+	m_applicationList->setIconSize(iconSize);
+	// For itemEntered, hovering an application prefetches what selecting it will show
+	m_applicationList->setMouseTracking(true);
+
+	// Searching and filtering are enabled once everything is loaded
 	m_searchBox = new QLineEdit;
 	m_searchBox->setPlaceholderText(tr("Search for Application"));
+	m_searchBox->setEnabled(false);
 
 	m_groupChooser = new QPushButton;
 	m_groupChooser->setText(tr("All"));
+	m_groupChooser->setEnabled(false);
 
 	m_mimegroupMenu = new QMenu(m_groupChooser);
 	m_mimegroupMenu->addAction(tr("All"));
-	QStringList sorted_mimegroups = m_xdgMimeApps.getMimeGroups().values();
-	std::sort(sorted_mimegroups.begin(), sorted_mimegroups.end());
-	for (const QString &mimegroup : sorted_mimegroups) {
-		m_mimegroupMenu->addAction(mimegroup);
-	}
 	m_groupChooser->setMenu(m_mimegroupMenu);
 
 	// Help button
@@ -124,7 +63,7 @@ SelectDefaultApplication::SelectDefaultApplication(QWidget *parent, bool isVerbo
 	leftLayout->addWidget(m_applicationList);
 
 	// Middle section
-	m_middleBanner = new QLabel(tr("Select an application to see its defaults."));
+	m_middleBanner = new QLabel(tr("Loading applications..."));
 	m_middleBanner->setWordWrap(true);
 	m_middleBanner->setMinimumHeight(40);
 	m_middleBanner->setAlignment(Qt::AlignLeft | Qt::AlignVCenter);
@@ -132,6 +71,7 @@ SelectDefaultApplication::SelectDefaultApplication(QWidget *parent, bool isVerbo
 	m_mimetypeList = new QListWidget;
 	m_mimetypeList->setUniformItemSizes(true);
 	m_mimetypeList->setSelectionMode(QAbstractItemView::ExtendedSelection);
+	m_mimetypeList->setIconSize(iconSize);
 
 	m_setDefaultButton = new QPushButton(tr("Add association(s)"));
 	m_setDefaultButton->setEnabled(false);
@@ -148,7 +88,9 @@ SelectDefaultApplication::SelectDefaultApplication(QWidget *parent, bool isVerbo
 	m_rightBanner->setAlignment(Qt::AlignLeft | Qt::AlignVCenter);
 
 	m_currentDefaultApps = new QListWidget;
+	m_currentDefaultApps->setUniformItemSizes(true);
 	m_currentDefaultApps->setSelectionMode(QAbstractItemView::SingleSelection);
+	m_currentDefaultApps->setIconSize(iconSize);
 
 	m_removeDefaultButton = new QPushButton(tr("Remove association(s)"));
 	m_removeDefaultButton->setEnabled(false);
@@ -158,6 +100,12 @@ SelectDefaultApplication::SelectDefaultApplication(QWidget *parent, bool isVerbo
 	rightLayout->addWidget(m_currentDefaultApps);
 	rightLayout->addWidget(m_removeDefaultButton);
 
+	// Icons are drawn from the cache when rows are painted, so rows not on screen hold none
+	IconDelegate *iconDelegate = new IconDelegate(&m_iconCache, this);
+	m_applicationList->setItemDelegate(iconDelegate);
+	m_mimetypeList->setItemDelegate(iconDelegate);
+	m_currentDefaultApps->setItemDelegate(iconDelegate);
+
 	// Main layout and connections
 	QHBoxLayout *mainLayout = new QHBoxLayout;
 	setLayout(mainLayout);
@@ -167,6 +115,8 @@ SelectDefaultApplication::SelectDefaultApplication(QWidget *parent, bool isVerbo
 
 	connect(m_applicationList, &QListWidget::itemSelectionChanged, this,
 		&SelectDefaultApplication::onApplicationSelected);
+	connect(m_applicationList, &QListWidget::itemEntered, this,
+		&SelectDefaultApplication::prefetchHoveredApplication);
 	connect(m_mimetypeList, &QListWidget::itemActivated, this, &SelectDefaultApplication::enableSetDefaultButton);
 	connect(m_currentDefaultApps, &QListWidget::itemSelectionChanged, this,
 		&SelectDefaultApplication::enableSetDefaultButton);
@@ -178,10 +128,296 @@ SelectDefaultApplication::SelectDefaultApplication(QWidget *parent, bool isVerbo
 
 	// Set a reasonable default window size
 	resize(1000, 600);
+
+	m_descriptionTimer = new QTimer(this);
+	connect(m_descriptionTimer, &QTimer::timeout, this, &SelectDefaultApplication::fillDescriptionCache);
+	m_prefetchTimer = new QTimer(this);
+	connect(m_prefetchTimer, &QTimer::timeout, this, &SelectDefaultApplication::prefetchNextMimetypes);
+
+	startLoading();
 }
 
 SelectDefaultApplication::~SelectDefaultApplication()
 {
+	// The loader posts its results to this object, make sure it's done before we go away
+	m_cancelLoading = true;
+	if (m_loaderThread) {
+		m_loaderThread->wait();
+	}
+}
+
+/**
+ * Reads applications, mimeapps.list files and icon themes on a background thread.
+ * Application names are streamed into the (still disabled) list in batches as they are found,
+ * finishLoading() then takes over the loaded data and enables the GUI.
+ */
+void SelectDefaultApplication::startLoading()
+{
+	// Interval between application batches posted to the GUI, so streaming doesn't flood the event loop
+	static const int BATCH_INTERVAL_MS = 50;
+
+	// Icon theme settings are read here, QIcon's static state belongs to the GUI thread
+	QStringList iconSearchPaths;
+	for (const QString &searchPath : (QIcon::themeSearchPaths() + QIcon::fallbackSearchPaths())) {
+		iconSearchPaths.append(searchPath + QIcon::themeName());
+		iconSearchPaths.append(searchPath);
+	}
+
+	auto result = std::make_shared<LoadResult>();
+	const bool verbose = isVerbose;
+	m_loaderThread = QThread::create([this, result, iconSearchPaths, verbose]() {
+		result->xdgMimeApps = std::make_unique<XdgMimeApps>();
+
+		QStringList batch;
+		QElapsedTimer sinceLastBatch;
+		sinceLastBatch.start();
+		const auto postBatch = [this, &batch, &sinceLastBatch]() {
+			if (!batch.isEmpty()) {
+				QMetaObject::invokeMethod(
+					this, [this, batch]() { addLoadingBatch(batch); }, Qt::QueuedConnection);
+				batch.clear();
+			}
+			sinceLastBatch.restart();
+		};
+		result->xdgMimeApps->loadApplications(verbose, [&](const QString &appName) {
+			batch.append(appName);
+			if (sinceLastBatch.elapsed() >= BATCH_INTERVAL_MS) {
+				postBatch();
+			}
+		}, &m_cancelLoading);
+		postBatch();
+		if (m_cancelLoading) {
+			return;
+		}
+
+		result->xdgMimeApps->loadAllConfigs(verbose);
+		if (m_cancelLoading) {
+			return;
+		}
+
+		// We crawl the icon themes manually because non-Plasma-platforms icon loading is extremely
+		// slow (I blame GTK and its crappy icon cache)
+		// TODO: check if QT_QPA_PLATFORMTHEME is set to plasma or sandsmark,
+		// if so just use the functioning QIcon::fromTheme()
+		QHash<QString, QString> iconPaths;
+		for (const QString &searchPath : iconSearchPaths) {
+			loadIcons(searchPath, iconPaths, m_cancelLoading);
+		}
+		if (m_cancelLoading) {
+			return;
+		}
+		// Resolve icons for all mimetypes and applications up front, so it doesn't get sluggish
+		// when selecting applications supporting a lot; the rest of the theme isn't kept
+		result->mimeTypeIconPaths = resolveMimeTypeIconPaths(*result->xdgMimeApps, iconPaths);
+		result->applicationIconPaths = resolveApplicationIconPaths(*result->xdgMimeApps, iconPaths);
+		result->sortedApplications = sortApplications(*result->xdgMimeApps);
+		result->applicationMimetypes = buildApplicationMimetypes(*result->xdgMimeApps);
+
+		QMetaObject::invokeMethod(this, [this, result]() { finishLoading(result); }, Qt::QueuedConnection);
+	});
+	m_loaderThread->setParent(this);
+	m_loaderThread->start();
+}
+
+/**
+ * Orders applications by their display name for the user's locale.
+ * Every name gets one collation key, so sorting doesn't collate the same strings over and over.
+ */
+QStringList SelectDefaultApplication::sortApplications(const XdgMimeApps &xdgMimeApps)
+{
+	QCollator collator;
+	collator.setCaseSensitivity(Qt::CaseInsensitive);
+	collator.setNumericMode(true);
+
+	const auto &apps = xdgMimeApps.getApps();
+	std::vector<std::pair<QCollatorSortKey, QString> > keyed;
+	keyed.reserve(apps.size());
+	for (auto it = apps.keyBegin(); it != apps.keyEnd(); ++it) {
+		// OnlyShowIn/NotShowIn entries for other desktops stay usable, they just aren't listed
+		if (xdgMimeApps.isApplicationShown(*it)) {
+			keyed.emplace_back(collator.sortKey(xdgMimeApps.getDisplayName(*it)), *it);
+		}
+	}
+	std::sort(keyed.begin(), keyed.end(), [](const auto &a, const auto &b) {
+		const int order = a.first.compare(b.first);
+		return order != 0 ? order < 0 : a.second < b.second;
+	});
+
+	QStringList sorted;
+	sorted.reserve(keyed.size());
+	for (const auto &entry : keyed) {
+		sorted.append(entry.second);
+	}
+	return sorted;
+}
+
+/**
+ * Sorts the declared and implied MIME types of every application and records where each
+ * mimegroup starts and ends, so selecting an application or a group only slices these lists.
+ */
+QHash<QString, SelectDefaultApplication::ApplicationMimetypes>
+SelectDefaultApplication::buildApplicationMimetypes(const XdgMimeApps &xdgMimeApps)
+{
+	const auto &apps = xdgMimeApps.getApps();
+	const MimeHierarchy &hierarchy = xdgMimeApps.getMimeHierarchy();
+	QHash<QString, ApplicationMimetypes> result;
+	result.reserve(apps.size());
+	for (auto it = apps.begin(); it != apps.end(); ++it) {
+		const QHash<QString, QString> &officiallySupported = it.value();
+		ApplicationMimetypes &mimetypes = result[it.key()];
+		mimetypes.official = officiallySupported.keys();
+
+		// E. g. kwrite and kate only indicate support for "text/plain", but they're nice for things like C source files.
+		// The hierarchy is transitive, so text/x-c++src is found through text/plain -> text/x-csrc as well.
+		QSet<QString> impliedSupported;
+		for (auto mit = officiallySupported.keyBegin(); mit != officiallySupported.keyEnd(); ++mit) {
+			for (const int child : hierarchy.descendants(*mit)) {
+				const QString &childName = hierarchy.nameOf(child);
+				// Ensure that the officially supported keys don't contain this value
+				if (!officiallySupported.contains(childName)) {
+					impliedSupported.insert(childName);
+				}
+			}
+		}
+		mimetypes.implied = impliedSupported.values();
+
+		mimetypes.official.sort();
+		mimetypes.implied.sort();
+		mimetypes.officialGroups = mimegroupRanges(mimetypes.official);
+		mimetypes.impliedGroups = mimegroupRanges(mimetypes.implied);
+	}
+	return result;
+}
+
+QHash<QString, SelectDefaultApplication::MimegroupRange>
+SelectDefaultApplication::mimegroupRanges(const QStringList &sortedMimetypes)
+{
+	QHash<QString, MimegroupRange> ranges;
+	int begin = 0;
+	while (begin < sortedMimetypes.size()) {
+		const QString mimegroup = sortedMimetypes[begin].section('/', 0, 0);
+		const QString prefix = mimegroup + '/';
+		int end = begin + 1;
+		while (end < sortedMimetypes.size() && sortedMimetypes[end].startsWith(prefix)) {
+			end++;
+		}
+		ranges.insert(mimegroup, { begin, end });
+		begin = end;
+	}
+	return ranges;
+}
+
+// All rows without a mimegroup filter, otherwise only the filtered group's (possibly empty) range
+SelectDefaultApplication::MimegroupRange
+SelectDefaultApplication::filteredRange(const QStringList &mimetypes, const QHash<QString, MimegroupRange> &groups) const
+{
+	if (m_filterMimegroup.isEmpty()) {
+		return { 0, int(mimetypes.size()) };
+	}
+	return groups.value(m_filterMimegroup, { 0, 0 });
+}
+
+void SelectDefaultApplication::addLoadingBatch(const QStringList &appNames)
+{
+	// Shown greyed out until finishLoading(), there is nothing to select them for yet
+	for (const QString &appName : appNames) {
+		QListWidgetItem *item = new QListWidgetItem(appName);
+		RuntimeStats::add(RuntimeStats::ListItemsCreated);
+		item->setFlags(Qt::NoItemFlags);
+		m_applicationList->addItem(item);
+	}
+	m_applicationList->sortItems();
+}
+
+void SelectDefaultApplication::finishLoading(const std::shared_ptr<LoadResult> &result)
+{
+	m_xdgMimeApps = std::move(result->xdgMimeApps);
+	m_applicationIconPaths = std::move(result->applicationIconPaths);
+	m_mimeTypeIconPaths = std::move(result->mimeTypeIconPaths);
+	m_sortedApplications = std::move(result->sortedApplications);
+	m_applicationMimetypes = std::move(result->applicationMimetypes);
+	m_applicationRanks.clear();
+	m_applicationRanks.reserve(m_sortedApplications.size());
+	for (int i = 0; i < m_sortedApplications.size(); i++) {
+		m_applicationRanks.insert(m_sortedApplications[i], i);
+	}
+	// The window is shown by now, so this is the device pixel ratio of the screen it's on
+	m_iconCache.setTargetSize(m_applicationList->iconSize(), devicePixelRatioF());
+
+	// Sync human-readable names with XDG defaults, the configs were already loaded by the loader
+	syncDefaultApps();
+
+	QStringList sorted_mimegroups = m_xdgMimeApps->getMimeGroups().values();
+	std::sort(sorted_mimegroups.begin(), sorted_mimegroups.end());
+	for (const QString &mimegroup : sorted_mimegroups) {
+		m_mimegroupMenu->addAction(mimegroup);
+	}
+
+	rebuildSearchIndex();
+	populateApplicationList("");
+
+	m_searchBox->setEnabled(true);
+	m_groupChooser->setEnabled(true);
+	m_middleBanner->setText(tr("Select an application to see its defaults."));
+
+	const MimeHierarchy &hierarchy = m_xdgMimeApps->getMimeHierarchy();
+	m_pendingDescriptions.reserve(hierarchy.size());
+	for (int id = 0; id < hierarchy.size(); id++) {
+		m_pendingDescriptions.append(hierarchy.nameOf(id));
+	}
+	m_descriptionTimer->start(0);
+}
+
+// Maps every supported mimetype to an icon file, or to an empty path for the "unknown" icon
+QHash<QString, QString> SelectDefaultApplication::resolveMimeTypeIconPaths(const XdgMimeApps &xdgMimeApps,
+									   const QHash<QString, QString> &iconPaths)
+{
+	const QMimeDatabase mimeDb;
+	QHash<QString, QString> mimeTypeIconPaths;
+	const MimeHierarchy &hierarchy = xdgMimeApps.getMimeHierarchy();
+	for (int id = 0; id < hierarchy.size(); id++) {
+		const QString &mimetypeName = hierarchy.nameOf(id);
+		// Here we actually want to use the real mimetype, because we need to access its iconName
+		const QMimeType mimetype = mimeDb.mimeTypeForName(mimetypeName);
+		RuntimeStats::add(RuntimeStats::MimeLookups);
+
+		QString iconName = mimetype.iconName();
+		QString path = iconPaths.value(iconName);
+		if (path.isEmpty()) {
+			path = iconPaths.value(mimetype.genericIconName());
+		}
+		if (path.isEmpty()) {
+			const int split = iconName.lastIndexOf('+');
+			if (split != -1) {
+				iconName.truncate(split);
+				path = iconPaths.value(iconName);
+			}
+		}
+		if (path.isEmpty()) {
+			const int split = iconName.lastIndexOf('-');
+			if (split != -1) {
+				iconName.truncate(split);
+				path = iconPaths.value(iconName);
+			}
+		}
+		mimeTypeIconPaths.insert(mimetypeName, path);
+	}
+	return mimeTypeIconPaths;
+}
+
+// Maps applications to their icon file, from the theme or an absolute Icon= path
+QHash<QString, QString> SelectDefaultApplication::resolveApplicationIconPaths(const XdgMimeApps &xdgMimeApps,
+									      const QHash<QString, QString> &iconPaths)
+{
+	QHash<QString, QString> applicationIconPaths;
+	const auto &appIcons = xdgMimeApps.getApplicationIcons();
+	for (auto it = appIcons.begin(); it != appIcons.end(); ++it) {
+		const QString path = it->startsWith('/') ? *it : iconPaths.value(*it);
+		if (!path.isEmpty()) {
+			applicationIconPaths.insert(it.key(), path);
+		}
+	}
+	return applicationIconPaths;
 }
 
 /**
@@ -205,14 +441,15 @@ void SelectDefaultApplication::onApplicationSelectedLogic(bool allowEnabled)
 	}
 
 	const QListWidgetItem *item = selectedItems.first();
-	const QString appName = item->data(0).toString();
+	const QString appName = item->data(Qt::UserRole).toString();
+	const QString displayName = m_xdgMimeApps->getDisplayName(appName);
 
 	// Set banners and right widget
-	m_middleBanner->setText(appName + tr(" can open:"));
-	m_rightBanner->setText(appName + tr(" currently opens:"));
+	m_middleBanner->setText(displayName + tr(" can open:"));
+	m_rightBanner->setText(displayName + tr(" currently opens:"));
 	m_currentDefaultApps->clear();
 
-	QStringList currentMimes = m_defaultApps.keys(appName);
+	const QSet<QString> currentMimes = m_applicationDefaults.value(appName);
 	qCDebug(sdaLog) << "SelectDefaultApplication: Application" << appName << "currently opens"
 			<< currentMimes.count() << "file types";
 
@@ -220,45 +457,114 @@ void SelectDefaultApplication::onApplicationSelectedLogic(bool allowEnabled)
 		addToMimetypeList(m_currentDefaultApps, mimetype, false);
 	}
 
-	const auto &apps = m_xdgMimeApps.getApps();
-	const auto &childMimeTypes = m_xdgMimeApps.getChildMimeTypes();
-	const QHash<QString, QString> &officiallySupported = apps.value(appName);
-
-	// E. g. kwrite and kate only indicate support for "text/plain", but they're nice for things like C source files.
-	QSet<QString> impliedSupported;
-	for (const QString &mimetype : officiallySupported.keys()) {
-		for (const QString &child : childMimeTypes.values(mimetype)) {
-			// Ensure that the officially supported keys don't contain this value
-			if (!officiallySupported.contains(child)) {
-				impliedSupported.insert(child);
-			}
+	const auto mimetypes = m_applicationMimetypes.constFind(appName);
+	if (mimetypes != m_applicationMimetypes.constEnd()) {
+		const MimegroupRange official = filteredRange(mimetypes->official, mimetypes->officialGroups);
+		for (int i = official.first; i < official.second; i++) {
+			addToMimetypeList(m_mimetypeList, mimetypes->official[i], true);
+		}
+		const MimegroupRange implied = filteredRange(mimetypes->implied, mimetypes->impliedGroups);
+		for (int i = implied.first; i < implied.second; i++) {
+			addToMimetypeList(m_mimetypeList, mimetypes->implied[i], false);
 		}
 	}
 
-	for (const QString &mimetype : officiallySupported.keys()) {
-		if (mimetype.startsWith(m_filterMimegroup)) {
-			addToMimetypeList(m_mimetypeList, mimetype, true);
+	m_setDefaultButton->setEnabled(allowEnabled && m_mimetypeList->count() > 0);
+	m_removeDefaultButton->setEnabled(false);
+
+	prefetchNeighbours(item);
+}
+
+void SelectDefaultApplication::prefetchHoveredApplication(QListWidgetItem *item)
+{
+	const QString appName = item->data(Qt::UserRole).toString();
+	if (!appName.isEmpty()) {
+		queuePrefetch({ appName });
+	}
+}
+
+// Arrow keys move to the row above or below, so those are the likely next selections
+void SelectDefaultApplication::prefetchNeighbours(const QListWidgetItem *item)
+{
+	const int row = m_applicationList->row(item);
+	QStringList appNames;
+	for (const int neighbour : { row + 1, row - 1 }) {
+		const QListWidgetItem *neighbourItem = m_applicationList->item(neighbour);
+		if (neighbourItem) {
+			appNames.append(neighbourItem->data(Qt::UserRole).toString());
 		}
 	}
-	for (const QString &mimetype : impliedSupported) {
-		if (mimetype.startsWith(m_filterMimegroup)) {
-			addToMimetypeList(m_mimetypeList, mimetype, false);
+	queuePrefetch(appNames);
+}
+
+/**
+ * Replaces whatever is still pending with the rows of these applications, as the newest
+ * hover or selection is the best guess of what comes next. Rows outside the current
+ * mimegroup filter aren't shown, so they're skipped.
+ */
+void SelectDefaultApplication::queuePrefetch(const QStringList &appNames)
+{
+	m_prefetchMimetypes.clear();
+	for (const QString &appName : appNames) {
+		const auto mimetypes = m_applicationMimetypes.constFind(appName);
+		if (mimetypes == m_applicationMimetypes.constEnd()) {
+			continue;
+		}
+		const MimegroupRange official = filteredRange(mimetypes->official, mimetypes->officialGroups);
+		const MimegroupRange implied = filteredRange(mimetypes->implied, mimetypes->impliedGroups);
+		for (int i = official.first; i < official.second; i++) {
+			m_prefetchMimetypes.append(mimetypes->official[i]);
 		}
+		for (int i = implied.first; i < implied.second; i++) {
+			m_prefetchMimetypes.append(mimetypes->implied[i]);
+		}
+	}
+	if (m_prefetchMimetypes.isEmpty()) {
+		m_prefetchTimer->stop();
+	} else {
+		m_prefetchTimer->start(0);
 	}
+}
 
-	m_setDefaultButton->setEnabled(allowEnabled && m_mimetypeList->count() > 0);
-	m_removeDefaultButton->setEnabled(false);
+// A few rows per timer tick, so input events are never kept waiting behind a prefetch
+void SelectDefaultApplication::prefetchNextMimetypes()
+{
+	static const int BATCH_SIZE = 16;
+	int prefetched = 0;
+	while (prefetched < BATCH_SIZE && !m_prefetchMimetypes.isEmpty()) {
+		const QString name = m_prefetchMimetypes.takeFirst();
+		const QString iconPath = m_mimeTypeIconPaths.value(name);
+		if (m_mimeDescriptions.contains(name) && (iconPath.isEmpty() || m_iconCache.contains(iconPath))) {
+			continue;
+		}
+		mimetypeDescription(name);
+		if (!iconPath.isEmpty()) {
+			m_iconCache.icon(iconPath);
+		}
+		prefetched++;
+	}
+	RuntimeStats::add(RuntimeStats::MimetypesPrefetched, prefetched);
+	if (m_prefetchMimetypes.isEmpty()) {
+		m_prefetchTimer->stop();
+	}
 }
 void SelectDefaultApplication::addToMimetypeList(QListWidget *list, const QString &mimetypeName, const bool selected)
 {
 	QString description = mimetypeDescription(mimetypeName);
 	QListWidgetItem *item = new QListWidgetItem(description);
+	RuntimeStats::add(RuntimeStats::ListItemsCreated);
 	item->setData(Qt::UserRole, mimetypeName);
-	item->setIcon(m_mimeTypeIcons[mimetypeName]);
+	setMimetypeIcon(item, mimetypeName);
 	list->addItem(item);
 	item->setSelected(selected);
 }
 
+void SelectDefaultApplication::setMimetypeIcon(QListWidgetItem *item, const QString &mimetypeName) const
+{
+	item->setData(IconDelegate::PathRole, m_mimeTypeIconPaths.value(mimetypeName));
+	item->setData(IconDelegate::ThemeNameRole, QStringLiteral("unknown"));
+}
+
 void SelectDefaultApplication::onSetDefaultClicked()
 {
 	QList<QListWidgetItem *> selectedItems = m_applicationList->selectedItems();
@@ -268,7 +574,7 @@ void SelectDefaultApplication::onSetDefaultClicked()
 
 	const QListWidgetItem *item = selectedItems.first();
 
-	const QString application = item->data(0).toString();
+	const QString application = item->data(Qt::UserRole).toString();
 	if (application.isEmpty()) {
 		return;
 	}
@@ -294,61 +600,27 @@ void SelectDefaultApplication::onSetDefaultClicked()
 // Removes values from mimetypes if warnings exist and the user requests to do a non-destructive change
 void SelectDefaultApplication::setDefault(const QString &appName, QSet<QString> &mimetypes)
 {
-	const QString filePath =
-		QDir(QStandardPaths::writableLocation(QStandardPaths::ConfigLocation)).absoluteFilePath("mimeapps.list");
-	QFile file(filePath);
+	QHash<QString, QString> defaults;
+	const auto &apps = m_xdgMimeApps->getApps();
+	for (const QString &mime : mimetypes) {
+		QString file = apps[appName].value(mime);
+		if (!file.isEmpty()) {
+			defaults.insert(mime, file);
+		}
+	}
 
-	// Read in existing mimeapps.list, skipping the lines for the mimetypes we're updating
-	QList<QByteArray> existingContent;
-	QList<QByteArray> existingAssociations;
+	// Conflicts come from the already loaded files, including desktop-specific ones that take precedence
+	const QHash<QString, XdgMimeApps::DefaultPreview> previews = m_xdgMimeApps->previewDefaults(defaults);
 	QHash<QString, QString> warnings;
-	if (file.open(QIODevice::ReadOnly)) {
-		bool inCorrectGroup = false;
-		while (!file.atEnd()) {
-			const QByteArray line = file.readLine().trimmed();
-
-			if (line.isEmpty()) {
-				continue;
-			}
-
-			if (line.startsWith('[')) {
-				inCorrectGroup = (line == "[Default Applications]");
-				if (!inCorrectGroup) {
-					existingContent.append(line);
-				}
-				continue;
-			}
-
-			if (!inCorrectGroup) {
-				existingContent.append(line);
-				continue;
-			}
-
-			if (!line.contains('=')) {
-				existingAssociations.append(line);
-				continue;
-			}
-
-			const QString mimetype = m_xdgMimeApps.normalizeMimeType(line.split('=').first().trimmed());
-			// If we aren't setting this mimetype, leave any entry, even others that this application owns
-			if (!mimetypes.contains(mimetype)) {
-				existingAssociations.append(line);
-				continue;
-			}
-
-			// Ensure that if a mimetype is selected and is set as default for a different application, we warn about it
-			const QString handlingAppFile = line.split('=')[1].trimmed();
-			const auto &apps = m_xdgMimeApps.getApps();
-			const QString appFile = apps[appName].value(mimetype);
-			if (appFile != handlingAppFile && apps[appName].contains(mimetype)) {
-				warnings[mimetype] = handlingAppFile;
-			}
+	for (auto it = previews.begin(); it != previews.end(); ++it) {
+		QStringList lines;
+		if (!it->currentDesktopId.isEmpty() && it->currentDesktopId != defaults.value(it.key())) {
+			lines.append(tr("Currently: %1 (from %2)").arg(it->currentDesktopId, it->currentSource));
 		}
-
-		file.close();
-	} else {
-		qWarning() << "Unable to open file for reading" << file.errorString();
-		// TODO If we can't open the file for reading, we better stop before opening for writing and deleting it
+		if (!it->shadowingDesktopId.isEmpty()) {
+			lines.append(tr("Will stay %1, shadowed by %2").arg(it->shadowingDesktopId, it->shadowingSource));
+		}
+		warnings.insert(it.key(), lines.join("\n  "));
 	}
 
 	// Display warnings and get user confirmation that we should proceed
@@ -358,48 +630,95 @@ void SelectDefaultApplication::setDefault(const QString &appName, QSet<QString>
 			return; // User canceled
 		}
 
-		// Remove mimes that user chose NOT to overwrite
-		for (const QString &warningType : warnings.keys()) {
-			if (!mimesToOverwrite.contains(warningType)) {
-				// Keep the existing association
-				const QString warning = warningType + '=' + warnings[warningType];
-				existingAssociations.append(warning.toUtf8());
-				// Remove from values to set
-				mimetypes.remove(warningType);
+		// Leave the ones the user chose NOT to overwrite alone
+		for (auto it = warnings.keyBegin(); it != warnings.keyEnd(); ++it) {
+			if (!mimesToOverwrite.contains(*it)) {
+				defaults.remove(*it);
+				mimetypes.remove(*it);
 			}
 		}
 	}
 
-	// Write the file
-	QHash<QString, QSet<QString> > fileToMimes;
-	const auto &apps = m_xdgMimeApps.getApps();
-	for (const QString &mime : mimetypes) {
-		QString file = apps[appName].value(mime);
-		if (!file.isEmpty()) {
-			fileToMimes[file].insert(mime);
+	// Write the file, once for all selected MIME types
+	// Snapshots are immutable, the edit goes to a copy that then replaces the current one
+	auto next = std::make_shared<XdgMimeApps>(*m_xdgMimeApps);
+	QSet<QString> changed;
+	next->setDefaults(defaults, &changed);
+	m_xdgMimeApps = std::move(next);
+
+	// Only the MIME types whose default changed need updating
+	applyDefaultChanges(changed);
+	// Make the button unclickable so there is always user feedback
+	m_setDefaultButton->setEnabled(false);
+}
+
+QString SelectDefaultApplication::defaultApplication(const QString &mimetype) const
+{
+	const QString desktopId = m_xdgMimeApps->getDefaultApp(mimetype);
+	if (desktopId.isEmpty()) {
+		return QString();
+	}
+	const auto &apps = m_xdgMimeApps->getApps();
+	for (const QString &appName : m_xdgMimeApps->getApplicationsForMimeType(mimetype)) {
+		const auto app = apps.constFind(appName);
+		if (app != apps.constEnd() && app->value(mimetype) == desktopId) {
+			return appName;
 		}
 	}
+	return QString();
+}
 
-	for (auto it = fileToMimes.begin(); it != fileToMimes.end(); ++it) {
-		m_xdgMimeApps.setDefaults(it.key(), it.value());
+/**
+ * Updates the defaults of only the given MIME types and the rows showing them,
+ * so an edit costs as much as it changed rather than a full resync.
+ */
+void SelectDefaultApplication::applyDefaultChanges(const QSet<QString> &changedMimetypes)
+{
+	QString selectedApp;
+	const QList<QListWidgetItem *> selectedItems = m_applicationList->selectedItems();
+	if (selectedItems.count() == 1) {
+		selectedApp = selectedItems.first()->data(Qt::UserRole).toString();
 	}
 
-	// Refresh everything from disk to ensure UI is in sync
-	readCurrentDefaultMimetypes();
-	// Redraw and make the button unclickable so there is always user feedback
-	onApplicationSelectedLogic(false);
+	for (const QString &mimetype : changedMimetypes) {
+		const QString before = m_defaultApps.value(mimetype);
+		const QString after = defaultApplication(mimetype);
+		if (before == after) {
+			continue;
+		}
+		if (!before.isEmpty()) {
+			m_applicationDefaults[before].remove(mimetype);
+		}
+		if (after.isEmpty()) {
+			m_defaultApps.remove(mimetype);
+		} else {
+			m_defaultApps.insert(mimetype, after);
+			m_applicationDefaults[after].insert(mimetype);
+		}
+
+		if (selectedApp.isEmpty()) {
+			continue;
+		}
+		if (after == selectedApp) {
+			addToMimetypeList(m_currentDefaultApps, mimetype, false);
+		} else if (before == selectedApp) {
+			for (int i = m_currentDefaultApps->count() - 1; i >= 0; i--) {
+				if (m_currentDefaultApps->item(i)->data(Qt::UserRole).toString() == mimetype) {
+					delete m_currentDefaultApps->takeItem(i);
+				}
+			}
+		}
+	}
+	qCDebug(sdaLog) << "SelectDefaultApplication: Updated" << changedMimetypes.size() << "changed defaults";
 }
 
-void SelectDefaultApplication::readCurrentDefaultMimetypes()
+void SelectDefaultApplication::syncDefaultApps()
 {
-	qCDebug(sdaLog) << "SelectDefaultApplication: Refreshing current default mimetypes...";
-	// Load all mimeapps.list files in XDG precedence order
-	m_xdgMimeApps.loadAllConfigs();
-
 	// Sync human-readable app names with their desktop file defaults
 	m_defaultApps.clear();
+	m_applicationDefaults.clear();
 
-	const auto &apps = m_xdgMimeApps.getApps();
+	const auto &apps = m_xdgMimeApps->getApps();
 	if (apps.isEmpty()) {
 		qCDebug(sdaLog)
 			<< "SelectDefaultApplication: Applications not loaded yet, skipping human-readable name sync";
@@ -417,52 +736,140 @@ void SelectDefaultApplication::readCurrentDefaultMimetypes()
 			const QString &mimetype = mit.key();
 			const QString &appFileId = mit.value();
 
-			if (m_xdgMimeApps.getDefaultApp(mimetype) == appFileId) {
+			if (m_xdgMimeApps->getDefaultApp(mimetype) == appFileId) {
 				m_defaultApps[mimetype] = appName;
 				syncCount++;
 			}
 		}
 	}
+	for (auto it = m_defaultApps.begin(); it != m_defaultApps.end(); ++it) {
+		m_applicationDefaults[it.value()].insert(it.key());
+	}
 	qCDebug(sdaLog) << "SelectDefaultApplication: Sync-ed" << syncCount << "associations to UI";
 }
 
+// Search weights rank an application's own name above what it merely supports
+static const int NAME_WEIGHT = 4;
+static const int DESKTOP_ID_WEIGHT = 3;
+static const int MIMETYPE_WEIGHT = 2;
+static const int DESCRIPTION_WEIGHT = 1;
+
+/**
+ * Ranks applications for the search box.
+ * Applications match on their name and desktop IDs, or through any MIME type they support
+ * whose name or description matches, so "pdf" or "markdown" find the matching viewers and editors.
+ */
+QStringList SelectDefaultApplication::searchApplications(const QString &query) const
+{
+	QHash<QString, int> scores;
+	for (const SearchIndex::Match &match : m_appSearchIndex.search(query)) {
+		scores.insert(m_appSearchIndex.documentKey(match.document), match.score);
+	}
+	for (const SearchIndex::Match &match : m_mimeSearchIndex.search(query)) {
+		const QString &mimetype = m_mimeSearchIndex.documentKey(match.document);
+		const QStringList handlers = m_xdgMimeApps->getApplicationsForMimeType(mimetype);
+		for (const QString &appName : handlers) {
+			int &score = scores[appName];
+			score = std::max(score, match.score);
+		}
+	}
+
+	// "*.heic" or ".heic" lists what opens that extension, with the current default on top
+	if (query.startsWith('.') || query.startsWith("*.")) {
+		static const int EXTENSION_HANDLER_SCORE = 10000;
+		for (const QString &mimetype : m_xdgMimeApps->mimeTypesForFileName(query)) {
+			for (const QString &appName : m_xdgMimeApps->getApplicationsForMimeType(mimetype)) {
+				int &score = scores[appName];
+				score = std::max(score, EXTENSION_HANDLER_SCORE);
+			}
+			const QString defaultApp = m_defaultApps.value(mimetype);
+			if (!defaultApp.isEmpty()) {
+				scores[defaultApp] = 2 * EXTENSION_HANDLER_SCORE;
+			}
+		}
+	}
+
+	QStringList ranked = scores.keys();
+	// Equal scores keep the locale's alphabetical order
+	std::sort(ranked.begin(), ranked.end(), [this, &scores](const QString &a, const QString &b) {
+		const int scoreA = scores.value(a);
+		const int scoreB = scores.value(b);
+		return scoreA != scoreB ? scoreA > scoreB : m_applicationRanks.value(a) < m_applicationRanks.value(b);
+	});
+	return ranked;
+}
+
+void SelectDefaultApplication::rebuildSearchIndex()
+{
+	m_appSearchIndex.clear();
+	m_mimeSearchIndex.clear();
+
+	const auto &apps = m_xdgMimeApps->getApps();
+	for (auto it = apps.begin(); it != apps.end(); ++it) {
+		if (!m_applicationRanks.contains(it.key())) {
+			continue; // Not listed on these desktops
+		}
+		const int document = m_appSearchIndex.addDocument(it.key());
+		m_appSearchIndex.addField(document, it.key(), NAME_WEIGHT);
+		const QString displayName = m_xdgMimeApps->getDisplayName(it.key());
+		if (displayName != it.key()) {
+			m_appSearchIndex.addField(document, displayName, NAME_WEIGHT);
+		}
+		QSet<QString> desktopIds;
+		for (const QString &desktopId : it.value()) {
+			desktopIds.insert(desktopId);
+		}
+		for (const QString &desktopId : std::as_const(desktopIds)) {
+			m_appSearchIndex.addField(document, QString(desktopId).remove(".desktop"), DESKTOP_ID_WEIGHT);
+		}
+	}
+
+	const MimeHierarchy &hierarchy = m_xdgMimeApps->getMimeHierarchy();
+	for (int id = 0; id < hierarchy.size(); id++) {
+		const QString &mimetype = hierarchy.nameOf(id);
+		const int document = m_mimeSearchIndex.addDocument(mimetype);
+		m_mimeSearchIndex.addField(document, mimetype, MIMETYPE_WEIGHT);
+		// Descriptions that aren't cached yet get added once fillDescriptionCache() computes them
+		const auto description = m_mimeDescriptions.constFind(mimetype);
+		if (description != m_mimeDescriptions.constEnd()) {
+			m_mimeSearchIndex.addField(document, *description, DESCRIPTION_WEIGHT);
+		}
+	}
+}
+
 void SelectDefaultApplication::populateApplicationList(const QString &filter)
 {
 	m_applicationList->clear();
-	const auto &apps = m_xdgMimeApps.getApps();
-	const auto &appIcons = m_xdgMimeApps.getApplicationIcons();
-	QStringList sorted_app_names = apps.keys();
-	std::sort(sorted_app_names.begin(), sorted_app_names.end());
+	const auto &appIcons = m_xdgMimeApps->getApplicationIcons();
+	QStringList sorted_app_names;
+	if (filter.isEmpty()) {
+		sorted_app_names = m_sortedApplications;
+	} else {
+		sorted_app_names = searchApplications(filter);
+	}
 
 	for (const QString &appName : sorted_app_names) {
-		if (!filter.isEmpty() && !appName.contains(filter, Qt::CaseInsensitive)) {
-			continue;
-		}
-
 		if (!m_filterMimegroup.isEmpty() && !applicationHasAnyCorrectMimetype(appName)) {
 			continue;
 		}
 
-		QListWidgetItem *item = new QListWidgetItem(appName);
+		QListWidgetItem *item = new QListWidgetItem(m_xdgMimeApps->getDisplayName(appName));
 		item->setData(Qt::UserRole, appName);
+		RuntimeStats::add(RuntimeStats::ListItemsCreated);
 
-		QString iconName = appIcons.value(appName);
-		if (!iconName.isEmpty()) {
-			if (m_iconPaths.contains(iconName)) {
-				item->setIcon(QIcon(m_iconPaths.value(iconName)));
-			} else {
-				item->setIcon(QIcon::fromTheme(iconName));
-			}
-		} else {
-			// Fallback if no icon name (though XDG usually provides one)
-			item->setIcon(QIcon::fromTheme("application-x-executable"));
-		}
+		// Painted by the icon delegate; the theme is asked only for icons we didn't find a file for
+		item->setData(IconDelegate::PathRole, m_applicationIconPaths.value(appName));
+		const QString iconName = appIcons.value(appName);
+		// Fallback if no icon name (though XDG usually provides one)
+		item->setData(IconDelegate::ThemeNameRole,
+			      iconName.isEmpty() ? QStringLiteral("application-x-executable") : iconName);
 
 		m_applicationList->addItem(item);
 	}
 }
 
-void SelectDefaultApplication::loadIcons(const QString &path)
+void SelectDefaultApplication::loadIcons(const QString &path, QHash<QString, QString> &iconPaths,
+					 const std::atomic<bool> &cancel)
 {
 	QFileInfo icon_file(path);
 	if (!icon_file.exists() || !icon_file.isDir()) {
@@ -470,17 +877,25 @@ void SelectDefaultApplication::loadIcons(const QString &path)
 	}
 	// TODO: avoid hardcoding
 	QStringList imageTypes({ "*.svg", "*.svgz", "*.png", "*.xpm" });
-	QDirIterator iter(path, imageTypes, QDir::Files, QDirIterator::Subdirectories);
+	// Directories are listed too (name filters don't apply to them), only so they can be counted
+	QDirIterator iter(path, imageTypes, QDir::Files | QDir::AllDirs | QDir::NoDotAndDotDot,
+			  QDirIterator::Subdirectories);
+	RuntimeStats::add(RuntimeStats::DirectoriesStatted);
 
-	while (iter.hasNext()) {
+	// Icon themes can be huge, closing the window mustn't wait for the whole crawl
+	while (!cancel && iter.hasNext()) {
 		iter.next();
 		icon_file = iter.fileInfo();
+		if (icon_file.isDir()) {
+			RuntimeStats::add(RuntimeStats::DirectoriesStatted);
+			continue;
+		}
 
 		const QString name = icon_file.completeBaseName();
-		if (m_iconPaths.contains(name)) {
+		if (iconPaths.contains(name)) {
 			continue;
 		}
-		m_iconPaths[name] = icon_file.filePath();
+		iconPaths[name] = icon_file.filePath();
 	}
 }
 
@@ -515,12 +930,12 @@ void SelectDefaultApplication::onRemoveDefaultClicked()
 	for (QListWidgetItem *item : mimetypesToRemove) {
 		mimesToRemove.insert(item->data(Qt::UserRole).toString());
 	}
-	m_xdgMimeApps.removeDefaults(mimesToRemove);
-
-	// Refresh everything from disk
-	readCurrentDefaultMimetypes();
-	// Update UI panels
-	onApplicationSelectedLogic(false);
+	auto next = std::make_shared<XdgMimeApps>(*m_xdgMimeApps);
+	const QSet<QString> changed = next->removeDefaults(mimesToRemove);
+	m_xdgMimeApps = std::move(next);
+	applyDefaultChanges(changed);
+	m_setDefaultButton->setEnabled(false);
+	m_removeDefaultButton->setEnabled(false);
 }
 
 void SelectDefaultApplication::showHelp()
@@ -543,9 +958,54 @@ void SelectDefaultApplication::showHelp()
 		"<p>The tool <code>xdg-open</code> uses these entries to determine which application handles a file type, reading from system locations like <code>/usr/share/applications/</code> and user config at <code>~/.config/mimeapps.list</code>.</p>"
 		"<p>This program parses these files to visualize current associations. When you apply changes, it writes to your <code>mimeapps.list</code>, ensuring your preferences take precedence.</p>"
 		"</body></html>"));
+	if (RuntimeStats::isEnabled()) {
+		dialog->setDetailedText(statisticsReport());
+	}
 	dialog->exec();
 }
 
+QString SelectDefaultApplication::statisticsReport() const
+{
+	const auto &apps = m_xdgMimeApps->getApps();
+	qint64 associations = 0;
+	for (const QHash<QString, QString> &appMimetypes : apps) {
+		associations += appMimetypes.size();
+	}
+	const MimeHierarchy &hierarchy = m_xdgMimeApps->getMimeHierarchy();
+
+	QList<QPair<QString, qint64> > memory;
+	memory.append({ QStringLiteral("Applications (%1 apps, %2 types)").arg(apps.size()).arg(associations),
+			RuntimeStats::heapBytes(apps) });
+	memory.append({ QStringLiteral("Icon paths (%1)")
+				.arg(m_applicationIconPaths.size() + m_mimeTypeIconPaths.size()),
+			RuntimeStats::heapBytes(m_applicationIconPaths) + RuntimeStats::heapBytes(m_mimeTypeIconPaths) });
+	memory.append({ QStringLiteral("Decoded icons (%1, limit %2 KiB)")
+				.arg(m_iconCache.count())
+				.arg(m_iconCache.memoryLimit() / 1024),
+			m_iconCache.memoryUsed() });
+	memory.append({ QStringLiteral("MIME hierarchy (%1 pairs)").arg(hierarchy.edgeCount()),
+			hierarchy.estimatedBytes() });
+	qint64 applicationMimetypeBytes = 0;
+	for (auto it = m_applicationMimetypes.begin(); it != m_applicationMimetypes.end(); ++it) {
+		applicationMimetypeBytes += RuntimeStats::heapBytes(it.key()) + RuntimeStats::heapBytes(it->official) +
+					    RuntimeStats::heapBytes(it->implied) + RuntimeStats::heapBytes(it->officialGroups) +
+					    RuntimeStats::heapBytes(it->impliedGroups);
+	}
+	memory.append({ QStringLiteral("Application MIME type lists (%1)").arg(m_applicationMimetypes.size()),
+			applicationMimetypeBytes });
+	memory.append({ QStringLiteral("MIME descriptions (%1)").arg(m_mimeDescriptions.size()),
+			RuntimeStats::heapBytes(m_mimeDescriptions) });
+	memory.append({ QStringLiteral("Search index (%1 documents)")
+				.arg(m_appSearchIndex.size() + m_mimeSearchIndex.size()),
+			m_appSearchIndex.estimatedBytes() + m_mimeSearchIndex.estimatedBytes() });
+	return RuntimeStats::report(memory);
+}
+
+void SelectDefaultApplication::setIconMemoryLimit(qint64 bytes)
+{
+	m_iconCache.setMemoryLimit(bytes);
+}
+
 QSet<QString> SelectDefaultApplication::getGranularOverwriteConfirmation(const QHash<QString, QString> &warnings,
 									 const QString &newApp)
 {
@@ -565,13 +1025,13 @@ QSet<QString> SelectDefaultApplication::getGranularOverwriteConfirmation(const Q
 	QHash<QString, QCheckBox *> checkboxes;
 	for (auto it = warnings.begin(); it != warnings.end(); ++it) {
 		const QString &mimetype = it.key();
-		const QString &currentApp = it.value();
+		const QString &conflict = it.value();
 
 		QCheckBox *checkbox = new QCheckBox();
 		checkbox->setChecked(true); // Default to overwrite
 
-		// Format: "application/x-msi (currently: Bottles)"
-		QString labelText = QString("%1\n  Currently: %2").arg(mimetype, currentApp);
+		// Format: "application/x-msi\n  Currently: bottles.desktop (from ...)"
+		QString labelText = QString("%1\n  %2").arg(mimetype, conflict);
 		checkbox->setText(labelText);
 
 		checkboxes[mimetype] = checkbox;
@@ -606,31 +1066,54 @@ QSet<QString> SelectDefaultApplication::getGranularOverwriteConfirmation(const Q
 	return result;
 }
 
-bool SelectDefaultApplication::applicationHasAnyCorrectMimetype(const QString &appName)
+bool SelectDefaultApplication::applicationHasAnyCorrectMimetype(const QString &appName) const
 {
-	const QString &filter = m_filterMimegroup;
-	const auto &apps = m_xdgMimeApps.getApps();
-	const auto &childMimeTypes = m_xdgMimeApps.getChildMimeTypes();
-
-	if (!apps.contains(appName)) {
+	const auto mimetypes = m_applicationMimetypes.constFind(appName);
+	if (mimetypes == m_applicationMimetypes.constEnd()) {
 		return false;
 	}
+	// Implied types count too, e.g. an application with text/plain also matches text/x-csrc
+	return mimetypes->officialGroups.contains(m_filterMimegroup) ||
+	       mimetypes->impliedGroups.contains(m_filterMimegroup);
+}
 
-	const QHash<QString, QString> &appMimetypes = apps.value(appName);
-	for (auto it = appMimetypes.keyBegin(); it != appMimetypes.keyEnd(); ++it) {
-		if (it->startsWith(filter)) {
-			return true;
-		}
-		// Also check if any of the child mimetypes match
-		// E.g. if we have text/plain, we also match text/x-csrc
-		const QStringList children = childMimeTypes.values(*it);
-		for (const QString &child : children) {
-			if (child.startsWith(filter)) {
-				return true;
-			}
+// Descriptions are cached for the whole session, they only depend on the shared-mime-info database
+const QString SelectDefaultApplication::mimetypeDescription(const QString &name)
+{
+	const auto cached = m_mimeDescriptions.constFind(name);
+	if (cached != m_mimeDescriptions.constEnd()) {
+		RuntimeStats::add(RuntimeStats::MimeCacheHits);
+		return *cached;
+	}
+	const QString description = computeMimetypeDescription(name);
+	cacheMimetypeDescription(name, description);
+	return description;
+}
+
+void SelectDefaultApplication::cacheMimetypeDescription(const QString &name, const QString &description)
+{
+	m_mimeDescriptions.insert(name, description);
+	const int document = m_mimeSearchIndex.documentId(name);
+	if (document != -1) {
+		m_mimeSearchIndex.addField(document, description, DESCRIPTION_WEIGHT);
+	}
+}
+
+// Fills the description cache a few types at a time while the event loop is idle,
+// so the first clicks through applications already find their rows described
+void SelectDefaultApplication::fillDescriptionCache()
+{
+	static const int BATCH_SIZE = 32;
+	for (int i = 0; i < BATCH_SIZE && !m_pendingDescriptions.isEmpty(); i++) {
+		const QString name = m_pendingDescriptions.takeLast();
+		if (!m_mimeDescriptions.contains(name)) {
+			cacheMimetypeDescription(name, computeMimetypeDescription(name));
 		}
 	}
-	return false;
+	if (m_pendingDescriptions.isEmpty()) {
+		m_descriptionTimer->stop();
+		qCDebug(sdaLog) << "SelectDefaultApplication: Cached" << m_mimeDescriptions.size() << "MIME descriptions";
+	}
 }
 
 const char *X_SCHEME_HANDLER = "x-scheme-handler/";
@@ -638,7 +1121,7 @@ const char *X_SCHEME_HANDLER = "x-scheme-handler/";
 // mimeTypeForName(application/x-pkcs12) always returns application/x-pkcs12 instead of application/pkcs12
 // If starts with x-scheme-handler, instead just returns the argument
 
-const QString SelectDefaultApplication::mimetypeDescription(QString name)
+QString SelectDefaultApplication::computeMimetypeDescription(QString name) const
 {
 	if (name.startsWith(X_SCHEME_HANDLER)) {
 		// x-scheme-handler is not a valid mimetype for a file, but we do want to be able to set applications as the default handlers for it.
@@ -650,6 +1133,7 @@ const QString SelectDefaultApplication::mimetypeDescription(QString name)
 		name = "application/x-pkcs12";
 	}
 	const QMimeType mimetype = m_mimeDb.mimeTypeForName(name);
+	RuntimeStats::add(RuntimeStats::MimeLookups);
 	QString desc = mimetype.filterString().trimmed();
 	if (desc.isEmpty()) {
 		desc = mimetype.comment().trimmed();
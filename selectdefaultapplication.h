@@ -9,20 +9,34 @@
 #include <QLineEdit>
 #include <QSet>
 #include <QMenu>
+#include <atomic>
+#include <memory>
+#include "iconcache.h"
+#include "searchindex.h"
 #include "xdgmimeapps.h"
 
 class QFileInfo;
 class QTreeWidget;
 class QListWidget;
+class QListWidgetItem;
 class QPushButton;
+class QThread;
+class QTimer;
 
 class SelectDefaultApplication : public QWidget {
 	Q_OBJECT
+	// Drives the private slots directly to time them, see benchmarks/guibenchmark.cpp
+	friend class GuiBenchmark;
 
 public:
 	SelectDefaultApplication(QWidget *parent, bool isVerbose);
 	~SelectDefaultApplication() override;
 
+	// Counters and memory estimates for --stats
+	QString statisticsReport() const;
+	// Bytes of decoded icons kept for repainting, see IconCache
+	void setIconMemoryLimit(qint64 bytes);
+
 private slots:
 	void onApplicationSelected();
 	void onSetDefaultClicked();
@@ -31,33 +45,102 @@ private slots:
 	void constrictGroup(QAction *action);
 	void enableSetDefaultButton();
 	void onRemoveDefaultClicked();
+	void fillDescriptionCache();
+	void prefetchHoveredApplication(QListWidgetItem *item);
+	void prefetchNextMimetypes();
 
 private:
+	// Half-open range of rows in a sorted MIME type list
+	using MimegroupRange = QPair<int, int>;
+
+	// The MIME types an application declares and those implied by the hierarchy, sorted by name
+	// so every mimegroup is one contiguous range of rows
+	struct ApplicationMimetypes {
+		QStringList official;
+		QStringList implied;
+		QHash<QString, MimegroupRange> officialGroups;
+		QHash<QString, MimegroupRange> impliedGroups;
+	};
+
+	// Everything the background loader produces, handed over to the GUI thread in one go
+	struct LoadResult {
+		std::unique_ptr<XdgMimeApps> xdgMimeApps;
+		QHash<QString, QString> applicationIconPaths;
+		QHash<QString, QString> mimeTypeIconPaths;
+		QStringList sortedApplications;
+		QHash<QString, ApplicationMimetypes> applicationMimetypes;
+	};
+
+	void startLoading();
+	void addLoadingBatch(const QStringList &appNames);
+	void finishLoading(const std::shared_ptr<LoadResult> &result);
+	static QStringList sortApplications(const XdgMimeApps &xdgMimeApps);
+	static QHash<QString, ApplicationMimetypes> buildApplicationMimetypes(const XdgMimeApps &xdgMimeApps);
+	static QHash<QString, MimegroupRange> mimegroupRanges(const QStringList &sortedMimetypes);
+	MimegroupRange filteredRange(const QStringList &mimetypes, const QHash<QString, MimegroupRange> &groups) const;
+	static QHash<QString, QString> resolveMimeTypeIconPaths(const XdgMimeApps &xdgMimeApps,
+								const QHash<QString, QString> &iconPaths);
+	static QHash<QString, QString> resolveApplicationIconPaths(const XdgMimeApps &xdgMimeApps,
+								   const QHash<QString, QString> &iconPaths);
+
 	void setDefault(const QString &appName, QSet<QString> &mimetypes);
-	void loadIcons(const QString &path);
+	static void loadIcons(const QString &path, QHash<QString, QString> &iconPaths, const std::atomic<bool> &cancel);
 	void addToMimetypeList(QListWidget *list, const QString &mimetypeName, const bool selected);
-	void readCurrentDefaultMimetypes();
-	bool applicationHasAnyCorrectMimetype(const QString &appName);
+	void setMimetypeIcon(QListWidgetItem *item, const QString &mimetypeName) const;
+	void applyDefaultChanges(const QSet<QString> &changedMimetypes);
+	QString defaultApplication(const QString &mimetype) const;
+	void syncDefaultApps();
+	bool applicationHasAnyCorrectMimetype(const QString &appName) const;
 	void onApplicationSelectedLogic(bool allowEnable);
+	void queuePrefetch(const QStringList &appNames);
+	void prefetchNeighbours(const QListWidgetItem *item);
 
 	QSet<QString> getGranularOverwriteConfirmation(const QHash<QString, QString> &warnings, const QString &newApp);
-	const QString mimetypeDescription(QString name);
+	QStringList searchApplications(const QString &query) const;
+	void rebuildSearchIndex();
+	void cacheMimetypeDescription(const QString &name, const QString &description);
+	const QString mimetypeDescription(const QString &name);
+	QString computeMimetypeDescription(QString name) const;
 
 	// Global variable to match selected mimegroup on
 	QString m_filterMimegroup;
 	// Multi-hashtable with keys as mimetypes and values as application names
 	QHash<QString, QString> m_defaultApps;
+	// Inverse of m_defaultApps: application name -> the MIME types it currently opens
+	QHash<QString, QSet<QString> > m_applicationDefaults;
+	// Application names in the locale's collation order of their display names, computed once
+	QStringList m_sortedApplications;
+	QHash<QString, int> m_applicationRanks;
+	// Computed once by the loader, the applications don't change while the window is open
+	QHash<QString, ApplicationMimetypes> m_applicationMimetypes;
 
 	bool isVerbose;
 
-	// for preloading icons, because that's (a bit) slooow
-	QHash<QString, QIcon> m_mimeTypeIcons;
-	QHash<QString, QString> m_iconPaths;
+	// Icons are resolved to paths by the loader, because that's (a bit) slooow, and only
+	// rendered through m_iconCache when a row is painted; items hold paths, not icons
+	QHash<QString, QString> m_mimeTypeIconPaths;
+	QHash<QString, QString> m_applicationIconPaths;
+	IconCache m_iconCache;
+	// MIME type -> list row description, filled in the background after startup
+	QHash<QString, QString> m_mimeDescriptions;
+	QStringList m_pendingDescriptions;
+	QTimer *m_descriptionTimer;
+	// Rows of the applications the user is likely to select next (hovered, or next to the
+	// selection), whose descriptions and icons are warmed while the event loop is idle
+	QStringList m_prefetchMimetypes;
+	QTimer *m_prefetchTimer;
+
+	// Search box indexes: applications by name and desktop ID, MIME types by name and description
+	SearchIndex m_appSearchIndex;
+	SearchIndex m_mimeSearchIndex;
 
 	QMimeDatabase m_mimeDb;
 
-	// XDG MIME Apps specification compliant config manager
-	XdgMimeApps m_xdgMimeApps;
+	// XDG MIME Apps specification compliant config manager, replaced as a whole by the loader
+	// and by every edit, never modified in place
+	XdgMimeAppsSnapshot m_xdgMimeApps;
+	QThread *m_loaderThread = nullptr;
+	std::atomic<bool> m_cancelLoading{ false };
 
 	// UI elements
 	QListWidget *m_applicationList;
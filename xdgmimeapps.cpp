@@ -1,82 +1,236 @@
 #include "xdgmimeapps.h"
+#include "desktopentrykeys.h"
+#include <QDataStream>
+#include <QByteArrayView>
 #include <QDebug>
 #include <QDir>
 #include <QDirIterator>
 #include <QFile>
+#include <QMap>
+#include <QSaveFile>
 #include <QStandardPaths>
 #include <QMimeType>
-#include <QTextStream>
+#include <QRegularExpression>
 #include <QString>
+#include "runtimestats.h"
+#include <algorithm>
+#include <array>
+#include <memory_resource>
 
 using namespace Qt::StringLiterals;
 
 Q_LOGGING_CATEGORY(sdaLog, "sda.log")
 
-XdgMimeApps::XdgMimeApps()
+// Bump when the layout of the application directory cache changes
+static const quint32 MANIFEST_CACHE_VERSION = 1;
+
+namespace
 {
-	m_desktops = getCurrentDesktops();
+/**
+ * Scratch memory for parsing one file at a time on the current thread.
+ *
+ * Files are read into a per-thread monotonic arena and parsed through views, so a line
+ * costs no allocation at all; only the strings that are kept get copied out. Ending the
+ * scope releases everything at once, and the arena's initial block is reused by the
+ * next file, so typical desktop files never reach the heap for their temporaries.
+ * Scopes must not be nested.
+ */
+class ParseScope {
+public:
+	ParseScope() : m_arena(arena())
+	{
+	}
+	~ParseScope()
+	{
+		m_arena.release();
+	}
+	ParseScope(const ParseScope &) = delete;
+	ParseScope &operator=(const ParseScope &) = delete;
+
+	std::pmr::memory_resource *resource()
+	{
+		return &m_arena;
+	}
+
+	QByteArrayView read(QFile &file)
+	{
+		const qint64 size = file.size();
+		char *data = static_cast<char *>(m_arena.allocate(std::max<qint64>(size, 1), 1));
+		const qint64 bytesRead = file.read(data, size);
+		return QByteArrayView(data, std::max<qint64>(bytesRead, 0));
+	}
+
+private:
+	static std::pmr::monotonic_buffer_resource &arena()
+	{
+		static const size_t INITIAL_SIZE = 32 * 1024;
+		thread_local std::array<std::byte, INITIAL_SIZE> initialBlock;
+		thread_local std::pmr::monotonic_buffer_resource resource(initialBlock.data(), initialBlock.size());
+		return resource;
+	}
+
+	std::pmr::monotonic_buffer_resource &m_arena;
+};
+
+// Next trimmed line of data starting at pos, advancing pos past it
+QByteArrayView nextLine(QByteArrayView data, qsizetype &pos)
+{
+	qsizetype end = data.indexOf('\n', pos);
+	if (end < 0) {
+		end = data.size();
+	}
+	const QByteArrayView line = data.sliced(pos, end - pos).trimmed();
+	pos = end + 1;
+	return line;
 }
 
-QStringList XdgMimeApps::getCurrentDesktops()
+// Desktop names of an OnlyShowIn/NotShowIn value, lower-case like getCurrentDesktops()
+QStringList desktopNames(QByteArrayView value)
 {
-	QStringList desktops;
-	const QString xdgCurrentDesktop = qEnvironmentVariable("XDG_CURRENT_DESKTOP");
-	if (!xdgCurrentDesktop.isEmpty()) {
-		const QStringList parts = xdgCurrentDesktop.split(':', Qt::SkipEmptyParts);
-		for (const QString &part : parts) {
-			desktops.append(part.toLower());
+	QStringList names;
+	for (const QByteArray &name : value.toByteArray().split(';')) {
+		const QByteArray trimmed = name.trimmed();
+		if (!trimmed.isEmpty()) {
+			names.append(QString::fromUtf8(trimmed).toLower());
 		}
 	}
-	return desktops;
+	return names;
 }
 
-QStringList XdgMimeApps::getMimeAppsListPaths() const
+// Non-empty, trimmed entries of a ';' separated list, stored in the parse arena
+std::pmr::vector<QByteArrayView> splitList(QByteArrayView value, std::pmr::memory_resource *resource)
 {
-	QStringList paths;
+	std::pmr::vector<QByteArrayView> entries(resource);
+	qsizetype start = 0;
+	while (start <= value.size()) {
+		qsizetype end = value.indexOf(';', start);
+		if (end < 0) {
+			end = value.size();
+		}
+		const QByteArrayView entry = value.sliced(start, end - start).trimmed();
+		if (!entry.isEmpty()) {
+			entries.push_back(entry);
+		}
+		start = end + 1;
+	}
+	return entries;
+}
+}
 
+XdgEnvironment XdgEnvironment::current()
+{
+	XdgEnvironment environment;
 	// XDG_CONFIG_HOME (defaults to ~/.config)
-	const QString configHome = QStandardPaths::writableLocation(QStandardPaths::ConfigLocation);
-
+	environment.configHome = QStandardPaths::writableLocation(QStandardPaths::ConfigLocation);
 	// XDG_CONFIG_DIRS (defaults to /etc/xdg)
-	QStringList configDirs = QStandardPaths::standardLocations(QStandardPaths::ConfigLocation);
+	environment.configDirs = QStandardPaths::standardLocations(QStandardPaths::ConfigLocation);
 	// Remove configHome from configDirs to avoid duplicates
-	configDirs.removeOne(configHome);
-
+	environment.configDirs.removeOne(environment.configHome);
 	// XDG_DATA_HOME (defaults to ~/.local/share)
-	const QString dataHome = QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation);
-
+	environment.dataHome = QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation);
 	// XDG_DATA_DIRS (defaults to /usr/local/share:/usr/share)
-	QStringList dataDirs = QStandardPaths::standardLocations(QStandardPaths::GenericDataLocation);
-	dataDirs.removeOne(dataHome);
+	environment.dataDirs = QStandardPaths::standardLocations(QStandardPaths::GenericDataLocation);
+	environment.dataDirs.removeOne(environment.dataHome);
+	environment.desktops = XdgMimeApps::getCurrentDesktops();
+	environment.executableDirs = qEnvironmentVariable("PATH").split(':', Qt::SkipEmptyParts);
+	return environment;
+}
+
+XdgEnvironment XdgEnvironment::forHome(const QString &home) const
+{
+	XdgEnvironment environment = systemOnly();
+	environment.configHome = QDir(home).absoluteFilePath(".config");
+	environment.dataHome = QDir(home).absoluteFilePath(".local/share");
+	// Where per-user installs put their programs, $PATH has it when it exists
+	environment.executableDirs.prepend(QDir(home).absoluteFilePath(".local/bin"));
+	return environment;
+}
+
+XdgEnvironment XdgEnvironment::forRoot(const QString &root) const
+{
+	const auto underRoot = [&root](const QString &path) {
+		return path.isEmpty() ? path : QDir::cleanPath(root + '/' + path);
+	};
+	XdgEnvironment environment = *this;
+	environment.configHome = underRoot(configHome);
+	environment.dataHome = underRoot(dataHome);
+	for (QString &dir : environment.configDirs) {
+		dir = underRoot(dir);
+	}
+	for (QString &dir : environment.dataDirs) {
+		dir = underRoot(dir);
+	}
+	for (QString &dir : environment.executableDirs) {
+		dir = underRoot(dir);
+	}
+	environment.root = underRoot(environment.root.isEmpty() ? QString("/") : environment.root);
+	return environment;
+}
+
+XdgEnvironment XdgEnvironment::systemOnly() const
+{
+	XdgEnvironment environment = *this;
+	environment.configHome.clear();
+	environment.dataHome.clear();
+	// The running user's own bin directories are no program another user has
+	const QString ownHome = QDir::homePath() + '/';
+	environment.executableDirs.removeIf([&ownHome](const QString &dir) { return dir.startsWith(ownHome); });
+	return environment;
+}
+
+QString XdgEnvironment::userMimeAppsListPath() const
+{
+	return configHome.isEmpty() ? QString() : QDir(configHome).absoluteFilePath("mimeapps.list");
+}
+
+QStringList XdgEnvironment::applicationDirs() const
+{
+	QStringList dirs;
+	if (!dataHome.isEmpty()) {
+		dirs.append(QDir(dataHome).absoluteFilePath("applications"));
+	}
+	for (const QString &dataDir : dataDirs) {
+		dirs.append(QDir(dataDir).absoluteFilePath("applications"));
+	}
+	return dirs;
+}
+
+QStringList XdgEnvironment::mimeAppsListPaths() const
+{
+	QStringList paths;
 
 	// Build paths in precedence order (highest first)
-	// 1. Desktop-specific in config home
-	for (const QString &desktop : m_desktops) {
-		paths.append(QDir(configHome).absoluteFilePath(desktop + "-mimeapps.list"));
+	if (!configHome.isEmpty()) {
+		// 1. Desktop-specific in config home
+		for (const QString &desktop : desktops) {
+			paths.append(QDir(configHome).absoluteFilePath(desktop + "-mimeapps.list"));
+		}
+		// 2. Generic in config home
+		paths.append(QDir(configHome).absoluteFilePath("mimeapps.list"));
 	}
-	// 2. Generic in config home
-	paths.append(QDir(configHome).absoluteFilePath("mimeapps.list"));
 
 	// 3. Desktop-specific in config dirs
 	for (const QString &configDir : configDirs) {
-		for (const QString &desktop : m_desktops) {
+		for (const QString &desktop : desktops) {
 			paths.append(QDir(configDir).absoluteFilePath(desktop + "-mimeapps.list"));
 		}
 		paths.append(QDir(configDir).absoluteFilePath("mimeapps.list"));
 	}
 
-	// 4. Desktop-specific in data home applications
-	const QString dataHomeApps = QDir(dataHome).absoluteFilePath("applications");
-	for (const QString &desktop : m_desktops) {
-		paths.append(QDir(dataHomeApps).absoluteFilePath(desktop + "-mimeapps.list"));
+	if (!dataHome.isEmpty()) {
+		// 4. Desktop-specific in data home applications
+		const QString dataHomeApps = QDir(dataHome).absoluteFilePath("applications");
+		for (const QString &desktop : desktops) {
+			paths.append(QDir(dataHomeApps).absoluteFilePath(desktop + "-mimeapps.list"));
+		}
+		// 5. Generic in data home applications
+		paths.append(QDir(dataHomeApps).absoluteFilePath("mimeapps.list"));
 	}
-	// 5. Generic in data home applications
-	paths.append(QDir(dataHomeApps).absoluteFilePath("mimeapps.list"));
 
 	// 6. Data dirs applications
 	for (const QString &dataDir : dataDirs) {
 		const QString dataDirApps = QDir(dataDir).absoluteFilePath("applications");
-		for (const QString &desktop : m_desktops) {
+		for (const QString &desktop : desktops) {
 			paths.append(QDir(dataDirApps).absoluteFilePath(desktop + "-mimeapps.list"));
 		}
 		paths.append(QDir(dataDirApps).absoluteFilePath("mimeapps.list"));
@@ -85,69 +239,33 @@ QStringList XdgMimeApps::getMimeAppsListPaths() const
 	return paths;
 }
 
-void XdgMimeApps::loadAllConfigs(bool verbose)
+MimeAppsList MimeAppsList::parse(const QString &filePath, bool verbose)
 {
-	m_defaults.clear();
-	m_addedAssociations.clear();
-	m_removedAssociations.clear();
-	m_userDefaults.clear();
+	MimeAppsList list;
+	list.path = filePath;
+	// Desktop-specific files can only set defaults, not add/remove associations
+	list.desktopSpecific = QFileInfo(filePath).fileName().endsWith("-mimeapps.list");
 
-	const QString configHome = QStandardPaths::writableLocation(QStandardPaths::ConfigLocation);
-	const QStringList paths = getMimeAppsListPaths();
-
-	for (const QString &path : paths) {
-		QFileInfo fileInfo(path);
-		if (!fileInfo.exists()) {
-			continue;
-		}
-
-		// Desktop-specific files can only set defaults, not add/remove associations
-		const bool isDesktopSpecific = fileInfo.fileName().contains("-mimeapps.list");
-		const bool isUserConfig = path.startsWith(configHome);
-
-		parseMimeAppsList(path, isDesktopSpecific, verbose);
-
-		// Track user-level defaults for UI indication
-		if (isUserConfig && !isDesktopSpecific) {
-			// Re-parse to track which are user defaults
-			QFile file(path);
-			if (file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-				bool inDefaultApps = false;
-				while (!file.atEnd()) {
-					const QString line = QString::fromUtf8(file.readLine()).trimmed();
-					if (line.startsWith('[')) {
-						inDefaultApps = (line == "[Default Applications]");
-						continue;
-					}
-					if (inDefaultApps && line.contains('=')) {
-						const QString mimeType = line.section('=', 0, 0).trimmed();
-						m_userDefaults.insert(mimeType);
-					}
-				}
-			}
-		}
-	}
-}
-
-void XdgMimeApps::parseMimeAppsList(const QString &filePath, bool desktopSpecific, bool verbose)
-{
 	QFile file(filePath);
-	if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+	if (!file.open(QIODevice::ReadOnly)) {
 		if (verbose) {
 			qCDebug(sdaLog) << "XdgMimeApps: Could not open" << filePath;
 		}
-		return;
+		return list;
 	}
 
+	RuntimeStats::add(RuntimeStats::FilesOpened);
+	RuntimeStats::add(RuntimeStats::BytesRead, file.size());
 	if (verbose) {
 		qCDebug(sdaLog) << "XdgMimeApps: Parsing" << filePath;
 	}
 
-	enum Section { None, DefaultApplications, AddedAssociations, RemovedAssociations };
-	Section currentSection = None;
+	ParseScope scope;
+	const QByteArrayView data = scope.read(file);
+	QHash<QString, QStringList> *currentSection = nullptr;
 
-	while (!file.atEnd()) {
-		const QString line = QString::fromUtf8(file.readLine()).trimmed();
+	for (qsizetype pos = 0; pos < data.size();) {
+		const QByteArrayView line = nextLine(data, pos);
 
 		if (line.isEmpty() || line.startsWith('#')) {
 			continue;
@@ -155,66 +273,155 @@ void XdgMimeApps::parseMimeAppsList(const QString &filePath, bool desktopSpecifi
 
 		if (line.startsWith('[')) {
 			if (line == "[Default Applications]") {
-				currentSection = DefaultApplications;
+				currentSection = &list.defaults;
 			} else if (line == "[Added Associations]") {
-				currentSection = AddedAssociations;
+				currentSection = &list.addedAssociations;
 			} else if (line == "[Removed Associations]") {
-				currentSection = RemovedAssociations;
+				currentSection = &list.removedAssociations;
 			} else {
-				currentSection = None;
+				currentSection = nullptr;
 			}
 			continue;
 		}
 
-		if (!line.contains('=')) {
+		const qsizetype eqPos = line.indexOf('=');
+		if (!currentSection || eqPos < 0) {
 			continue;
 		}
 
-		const QString mimeType = line.section('=', 0, 0).trimmed();
-		const QString value = line.section('=', 1, -1).trimmed();
-		const QStringList desktopIds = value.split(';', Qt::SkipEmptyParts);
+		const QString mimeType = QString::fromUtf8(line.first(eqPos).trimmed());
+		// The first default for a key wins, repeated association keys accumulate
+		if (mimeType.isEmpty() || (currentSection == &list.defaults && !list.defaults.value(mimeType).isEmpty())) {
+			continue;
+		}
 
-		switch (currentSection) {
-		case DefaultApplications:
-			// First entry wins - only insert if not already present
-			if (!m_defaults.contains(mimeType)) {
-				// Take the first valid desktop ID from the list
-				for (const QString &desktopId : desktopIds) {
-					const QString trimmedId = desktopId.trimmed();
-					if (!trimmedId.isEmpty()) {
-						m_defaults.insert(mimeType, trimmedId);
-						break;
-					}
-				}
-			}
+		QStringList &desktopIds = (*currentSection)[mimeType];
+		for (const QByteArrayView desktopId : splitList(line.sliced(eqPos + 1), scope.resource())) {
+			desktopIds.append(QString::fromUtf8(desktopId));
+		}
+	}
+	return list;
+}
+
+XdgMimeApps::XdgMimeApps(const XdgEnvironment &environment) : m_environment(environment)
+{
+	for (const QString &key : localizedKeys("Name")) {
+		m_localizedNameKeys.append(key.toUtf8());
+	}
+}
+
+// Desktop entry keys for the message locale, most specific first, e.g. for "sr_RS@latin":
+// Name[sr_RS@latin], Name[sr_RS], Name[sr@latin], Name[sr]
+QStringList XdgMimeApps::localizedKeys(const QString &key)
+{
+	QString locale;
+	for (const char *variable : { "LC_ALL", "LC_MESSAGES", "LANG" }) {
+		locale = qEnvironmentVariable(variable);
+		if (!locale.isEmpty()) {
 			break;
+		}
+	}
+	if (locale.isEmpty() || locale == "C" || locale == "POSIX") {
+		return {};
+	}
 
-		case AddedAssociations:
-			// Desktop-specific files cannot add associations per spec
-			if (!desktopSpecific) {
-				for (const QString &desktopId : desktopIds) {
-					const QString trimmedId = desktopId.trimmed();
-					if (!trimmedId.isEmpty()) {
-						m_addedAssociations.insert(mimeType, trimmedId);
-					}
-				}
+	// lang_COUNTRY.ENCODING@MODIFIER, the encoding never takes part in matching
+	const QString modifier = locale.contains('@') ? locale.section('@', 1) : QString();
+	locale = locale.section('@', 0, 0).section('.', 0, 0);
+	const QString lang = locale.section('_', 0, 0);
+	const QString country = locale.contains('_') ? locale.section('_', 1) : QString();
+
+	QStringList keys;
+	if (!country.isEmpty() && !modifier.isEmpty()) {
+		keys.append(QString("%1[%2_%3@%4]").arg(key, lang, country, modifier));
+	}
+	if (!country.isEmpty()) {
+		keys.append(QString("%1[%2_%3]").arg(key, lang, country));
+	}
+	if (!modifier.isEmpty()) {
+		keys.append(QString("%1[%2@%3]").arg(key, lang, modifier));
+	}
+	keys.append(QString("%1[%2]").arg(key, lang));
+	return keys;
+}
+
+QStringList XdgMimeApps::getCurrentDesktops()
+{
+	QStringList desktops;
+	const QString xdgCurrentDesktop = qEnvironmentVariable("XDG_CURRENT_DESKTOP");
+	if (!xdgCurrentDesktop.isEmpty()) {
+		const QStringList parts = xdgCurrentDesktop.split(':', Qt::SkipEmptyParts);
+		for (const QString &part : parts) {
+			desktops.append(part.toLower());
+		}
+	}
+	return desktops;
+}
+
+QStringList XdgMimeApps::getMimeAppsListPaths() const
+{
+	return m_environment.mimeAppsListPaths();
+}
+
+void XdgMimeApps::loadAllConfigs(bool verbose, const QHash<QString, MimeAppsList> &parsedFiles)
+{
+	m_configFiles.clear();
+
+	const QStringList paths = getMimeAppsListPaths();
+	for (const QString &path : paths) {
+		const auto parsed = parsedFiles.constFind(path);
+		if (parsed != parsedFiles.constEnd()) {
+			m_configFiles.append(*parsed);
+			continue;
+		}
+		if (!QFileInfo::exists(path)) {
+			continue;
+		}
+		m_configFiles.append(MimeAppsList::parse(path, verbose));
+	}
+
+	resolveConfigs();
+}
+
+// Folds the parsed files, highest precedence first, into the effective associations
+void XdgMimeApps::resolveConfigs()
+{
+	m_defaults.clear();
+	m_defaultSources.clear();
+	m_addedAssociations.clear();
+	m_removedAssociations.clear();
+	m_userDefaults.clear();
+
+	const QString userConfig = m_environment.userMimeAppsListPath();
+	for (const MimeAppsList &list : std::as_const(m_configFiles)) {
+		for (auto it = list.defaults.begin(); it != list.defaults.end(); ++it) {
+			// First entry wins - only insert if not already present
+			if (!it->isEmpty() && !m_defaults.contains(it.key())) {
+				m_defaults.insert(it.key(), it->first());
+				m_defaultSources.insert(it.key(), list.path);
 			}
-			break;
+		}
 
-		case RemovedAssociations:
-			// Desktop-specific files cannot remove associations per spec
-			if (!desktopSpecific) {
-				for (const QString &desktopId : desktopIds) {
-					const QString trimmedId = desktopId.trimmed();
-					if (!trimmedId.isEmpty()) {
-						m_removedAssociations.insert(mimeType, trimmedId);
-					}
-				}
+		// Track user-level defaults for UI indication
+		if (list.path == userConfig) {
+			for (auto it = list.defaults.keyBegin(); it != list.defaults.keyEnd(); ++it) {
+				m_userDefaults.insert(*it);
 			}
-			break;
+		}
 
-		case None:
-			break;
+		// Desktop-specific files cannot add or remove associations per spec
+		if (list.desktopSpecific) {
+			continue;
+		}
+		for (auto it = list.addedAssociations.begin(); it != list.addedAssociations.end(); ++it) {
+			for (const QString &desktopId : *it) {
+				m_addedAssociations.insert(it.key(), desktopId);
+			}
+		}
+		for (auto it = list.removedAssociations.begin(); it != list.removedAssociations.end(); ++it) {
+			for (const QString &desktopId : *it) {
+				m_removedAssociations.insert(it.key(), desktopId);
+			}
 		}
 	}
 }
@@ -224,6 +431,149 @@ QString XdgMimeApps::getDefaultApp(const QString &mimeType) const
 	return m_defaults.value(mimeType, QString());
 }
 
+QString XdgMimeApps::getDefaultSource(const QString &mimeType) const
+{
+	return m_defaultSources.value(mimeType, QString());
+}
+
+XdgMimeApps XdgMimeApps::forDesktops(const QStringList &desktops, bool verbose,
+				     const QHash<QString, MimeAppsList> &parsedFiles) const
+{
+	// The applications are implicitly shared with this instance, only the configs are resolved again
+	XdgMimeApps copy(*this);
+	copy.m_environment.desktops = desktops;
+	copy.loadAllConfigs(verbose, parsedFiles);
+	return copy;
+}
+
+QHash<QString, XdgMimeApps::EffectiveHandler> XdgMimeApps::resolveEffectiveHandlers() const
+{
+	QHash<QString, EffectiveHandler> handlers;
+	handlers.reserve(m_mimeTypeApplications.size() + m_defaults.size());
+
+	// 1. Explicit defaults, the first installed entry in precedence order
+	for (const MimeAppsList &list : m_configFiles) {
+		for (auto it = list.defaults.begin(); it != list.defaults.end(); ++it) {
+			if (handlers.contains(it.key())) {
+				continue;
+			}
+			const QString desktopId = firstInstalled(*it);
+			if (!desktopId.isEmpty()) {
+				handlers.insert(it.key(), { desktopId, list.path });
+			}
+		}
+	}
+
+	// 2. Added associations, a removal hides entries of its own file and every lower one
+	QSet<QPair<QString, QString> > removed;
+	for (const MimeAppsList &list : m_configFiles) {
+		if (list.desktopSpecific) {
+			continue;
+		}
+		for (auto it = list.removedAssociations.begin(); it != list.removedAssociations.end(); ++it) {
+			for (const QString &desktopId : *it) {
+				removed.insert({ it.key(), desktopId });
+			}
+		}
+		for (auto it = list.addedAssociations.begin(); it != list.addedAssociations.end(); ++it) {
+			if (handlers.contains(it.key())) {
+				continue;
+			}
+			for (const QString &desktopId : *it) {
+				if (hasDesktopId(desktopId) && !removed.contains({ it.key(), desktopId })) {
+					handlers.insert(it.key(), { desktopId, list.path });
+					break;
+				}
+			}
+		}
+	}
+
+	// 3. Applications declaring the type themselves, from the most important directory and
+	// shown on these desktops; explicit configuration above may still pick hidden ones
+	for (auto it = m_mimeTypeApplications.begin(); it != m_mimeTypeApplications.end(); ++it) {
+		if (handlers.contains(it.key())) {
+			continue;
+		}
+		QString best;
+		qsizetype bestRank = 0;
+		for (const QString &appName : *it) {
+			const QString desktopId = m_apps.value(appName).value(it.key());
+			const qsizetype rank = m_desktopIdRanks.value(desktopId, m_desktopIdRanks.size());
+			if (removed.contains({ it.key(), desktopId }) || !isShownOnDesktops(desktopId)) {
+				continue;
+			}
+			if (best.isEmpty() || rank < bestRank) {
+				best = desktopId;
+				bestRank = rank;
+			}
+		}
+		if (!best.isEmpty()) {
+			handlers.insert(it.key(), { best, QString() });
+		}
+	}
+	return handlers;
+}
+
+QString XdgMimeApps::firstInstalled(const QStringList &desktopIds) const
+{
+	for (const QString &desktopId : desktopIds) {
+		if (hasDesktopId(desktopId)) {
+			return desktopId;
+		}
+	}
+	return QString();
+}
+
+QHash<QString, XdgMimeApps::DefaultPreview> XdgMimeApps::previewDefaults(const QHash<QString, QString> &defaults) const
+{
+	QHash<QString, DefaultPreview> previews;
+	const QString userConfig = m_environment.userMimeAppsListPath();
+	const QStringList paths = getMimeAppsListPaths();
+	const qsizetype userRank = paths.indexOf(userConfig);
+
+	// Each file's defaults by normalized key, a higher file may use an alias of the type we write
+	QList<QHash<QString, QStringList> > normalizedDefaults;
+	normalizedDefaults.reserve(m_configFiles.size());
+	for (const MimeAppsList &list : m_configFiles) {
+		QHash<QString, QStringList> &normalized = normalizedDefaults.emplace_back();
+		for (auto it = list.defaults.begin(); it != list.defaults.end(); ++it) {
+			// Scheme handlers and the like aren't in the MIME database, those keys stay as they are
+			const QString lookedUp = normalizeMimeType(it.key());
+			const QString mimeType = lookedUp.isEmpty() ? it.key() : lookedUp;
+			// The exact key wins over an alias in the same file
+			if (!normalized.contains(mimeType) || it.key() == mimeType) {
+				normalized.insert(mimeType, it.value());
+			}
+		}
+	}
+
+	for (auto it = defaults.begin(); it != defaults.end(); ++it) {
+		DefaultPreview preview;
+		const QString lookedUp = normalizeMimeType(it.key());
+		const QString mimeType = lookedUp.isEmpty() ? it.key() : lookedUp;
+		for (qsizetype i = 0; i < m_configFiles.size(); i++) {
+			const MimeAppsList &list = m_configFiles[i];
+			const QString desktopId = firstInstalled(normalizedDefaults[i].value(mimeType));
+			if (desktopId.isEmpty()) {
+				continue;
+			}
+			// Only files before the user's one can shadow what we write into it
+			if (list.path != userConfig && paths.indexOf(list.path) < userRank && desktopId != it.value()) {
+				preview.shadowingDesktopId = desktopId;
+				preview.shadowingSource = list.path;
+			}
+			preview.currentDesktopId = desktopId;
+			preview.currentSource = list.path;
+			break;
+		}
+		if (!preview.shadowingDesktopId.isEmpty() ||
+		    (!preview.currentDesktopId.isEmpty() && preview.currentDesktopId != it.value())) {
+			previews.insert(it.key(), preview);
+		}
+	}
+	return previews;
+}
+
 QStringList XdgMimeApps::getAssociatedApps(const QString &mimeType) const
 {
 	QStringList result;
@@ -245,47 +595,317 @@ bool XdgMimeApps::hasUserDefault(const QString &mimeType) const
 	return m_userDefaults.contains(mimeType);
 }
 
-void XdgMimeApps::loadApplications(bool verbose)
+void XdgMimeApps::loadApplications(bool verbose,
+				   const std::function<void(const QString &appName)> &onApplicationFound,
+				   const std::atomic<bool> *cancel)
 {
+	m_onApplicationFound = onApplicationFound;
+	m_cancel = cancel;
 	m_apps.clear();
 	m_applicationIcons.clear();
-	m_childMimeTypes.clear();
+	m_localizedNames.clear();
+	m_mimeHierarchy.clear();
+	m_mimeTypeApplications.clear();
 	m_mimegroups.clear();
+	m_desktopIds.clear();
+	m_desktopIdRanks.clear();
+	m_desktopRestrictions.clear();
+	m_hiddenDesktopIds.clear();
 
-	const QStringList appDirs = QStandardPaths::standardLocations(QStandardPaths::ApplicationsLocation);
+	// Only the running user's $PATH is worth caching, like the directory listings below
+	m_executables.load(m_environment.executableDirs, m_environment.root, m_environment == XdgEnvironment::current());
+
+	m_cachedManifests = readDirectoryManifests();
+	QHash<QString, DirectoryManifest> manifests;
+
+	const QStringList appDirs = m_environment.applicationDirs();
 	for (const QString &dirPath : appDirs) {
 		if (verbose) {
 			qCDebug(sdaLog) << "XdgMimeApps: Loading applications from" << dirPath;
 		}
-		QDir applicationsDir(dirPath);
-		const QFileInfoList files = applicationsDir.entryInfoList({ "*.desktop" }, QDir::Files);
-		for (const QFileInfo &file : files) {
-			loadDesktopFile(file.absoluteFilePath(), verbose);
+		scanApplicationsDirectory(QDir::cleanPath(dirPath), QString(), manifests, verbose);
+	}
+
+	const QHash<QString, DirectoryManifest> cachedManifests = std::move(m_cachedManifests);
+	m_cachedManifests.clear();
+	m_scannedApplicationDirs = manifests.keys();
+	m_onApplicationFound = nullptr;
+	const bool cancelled = m_cancel && *m_cancel;
+	m_cancel = nullptr;
+	// An interrupted scan is incomplete, it must neither be cached nor indexed
+	if (cancelled) {
+		return;
+	}
+
+	// Listings of other environments would only evict the entries the next normal start needs
+	if (manifests != cachedManifests && m_environment == XdgEnvironment::current()) {
+		writeDirectoryManifests(manifests);
+	}
+
+	buildApplicationIndexes(verbose);
+	buildFileNameIndex();
+}
+
+void XdgMimeApps::inheritApplications(const XdgMimeApps &system, bool verbose)
+{
+	// Qt containers are implicitly shared, so this copies nothing until a user adds an application
+	// Shares the system's listings, only the user's own bin directories are listed on top
+	m_executables = system.m_executables;
+	m_executables.addDirectories(m_environment.executableDirs);
+	m_mimeHierarchy = system.m_mimeHierarchy;
+	m_mimeTypeApplications = system.m_mimeTypeApplications;
+	m_extensionMimeTypes = system.m_extensionMimeTypes;
+	m_fileNameMimeTypes = system.m_fileNameMimeTypes;
+	m_otherGlobs = system.m_otherGlobs;
+	m_normalizedMimeTypes = system.m_normalizedMimeTypes;
+	m_mimegroups = system.m_mimegroups;
+	m_scannedApplicationDirs = system.m_scannedApplicationDirs;
+
+	// The user's directory comes first in the lookup order, so its entries are loaded before
+	// the system ones are merged in and replace those with the same desktop ID
+	m_apps.clear();
+	m_applicationIcons.clear();
+	m_localizedNames.clear();
+	m_desktopIds.clear();
+	m_desktopIdRanks.clear();
+	m_desktopRestrictions.clear();
+	m_hiddenDesktopIds.clear();
+	if (!m_environment.dataHome.isEmpty()) {
+		// Per-user listings are not worth persisting, they would evict the shared system entries
+		QHash<QString, DirectoryManifest> manifests;
+		m_cachedManifests.clear();
+		scanApplicationsDirectory(QDir::cleanPath(QDir(m_environment.dataHome).absoluteFilePath("applications")),
+					  QString(), manifests, verbose);
+		m_scannedApplicationDirs += manifests.keys();
+	}
+
+	if (m_desktopIds.isEmpty() && m_hiddenDesktopIds.isEmpty()) {
+		m_apps = system.m_apps;
+		m_applicationIcons = system.m_applicationIcons;
+		m_localizedNames = system.m_localizedNames;
+		m_desktopIds = system.m_desktopIds;
+		m_desktopIdRanks = system.m_desktopIdRanks;
+		m_desktopRestrictions = system.m_desktopRestrictions;
+		m_hiddenDesktopIds = system.m_hiddenDesktopIds;
+		return;
+	}
+
+	const auto overridden = [this](const QString &desktopId) {
+		return m_desktopIds.contains(desktopId) || m_hiddenDesktopIds.contains(desktopId);
+	};
+	for (auto app = system.m_apps.begin(); app != system.m_apps.end(); ++app) {
+		for (auto it = app->begin(); it != app->end(); ++it) {
+			if (!overridden(it.value()) && !m_apps[app.key()].contains(it.key())) {
+				m_apps[app.key()].insert(it.key(), it.value());
+			}
+		}
+		if (m_apps[app.key()].isEmpty()) {
+			m_apps.remove(app.key());
+		}
+	}
+	for (auto it = system.m_desktopRestrictions.begin(); it != system.m_desktopRestrictions.end(); ++it) {
+		if (!overridden(it.key())) {
+			m_desktopRestrictions.insert(it.key(), it.value());
+		}
+	}
+	for (auto it = system.m_applicationIcons.begin(); it != system.m_applicationIcons.end(); ++it) {
+		if (m_applicationIcons.value(it.key()).isEmpty()) {
+			m_applicationIcons[it.key()] = it.value();
 		}
 	}
+	for (auto it = system.m_localizedNames.begin(); it != system.m_localizedNames.end(); ++it) {
+		if (!m_localizedNames.contains(it.key())) {
+			m_localizedNames.insert(it.key(), it.value());
+		}
+	}
+	const QSet<QString> userDesktopIds = m_desktopIds;
+	const QSet<QString> userHiddenDesktopIds = m_hiddenDesktopIds;
+	const qsizetype userRanks = m_desktopIdRanks.size();
+	for (const QString &desktopId : system.m_desktopIds) {
+		if (!userHiddenDesktopIds.contains(desktopId)) {
+			m_desktopIds.insert(desktopId);
+		}
+		if (!userDesktopIds.contains(desktopId) && !userHiddenDesktopIds.contains(desktopId)) {
+			m_desktopIdRanks.insert(desktopId, userRanks + system.m_desktopIdRanks.value(desktopId));
+		}
+	}
+	for (const QString &desktopId : system.m_hiddenDesktopIds) {
+		if (!userDesktopIds.contains(desktopId)) {
+			m_hiddenDesktopIds.insert(desktopId);
+		}
+	}
+
+	m_mimeHierarchy.clear();
+	m_mimeTypeApplications.clear();
+	buildApplicationIndexes(verbose);
+}
+
+void XdgMimeApps::buildApplicationIndexes(bool verbose)
+{
+	// Precompute the hierarchy once so implied support doesn't need MIME lookups per query
+	for (auto app = m_apps.begin(); app != m_apps.end(); ++app) {
+		for (auto it = app->keyBegin(); it != app->keyEnd(); ++it) {
+			m_mimeTypeApplications[*it].append(app.key());
+		}
+	}
+	QSet<QString> declaredMimeTypes;
+	declaredMimeTypes.reserve(m_mimeTypeApplications.size());
+	for (auto it = m_mimeTypeApplications.begin(); it != m_mimeTypeApplications.end(); ++it) {
+		std::sort(it->begin(), it->end());
+		declaredMimeTypes.insert(it.key());
+	}
+	m_mimeHierarchy.build(declaredMimeTypes, QMimeDatabase());
+	if (verbose) {
+		qCDebug(sdaLog) << "XdgMimeApps: MIME hierarchy has" << m_mimeHierarchy.size() << "types and"
+				<< m_mimeHierarchy.edgeCount() << "implied pairs";
+	}
 }
 
-void XdgMimeApps::loadDesktopFile(const QString &filePath, bool verbose)
+void XdgMimeApps::scanApplicationsDirectory(const QString &dirPath, const QString &idPrefix,
+					    QHash<QString, DirectoryManifest> &manifests, bool verbose)
 {
+	const QFileInfo dirInfo(dirPath);
+	if (!dirInfo.isDir()) {
+		return;
+	}
+
+	// A directory's mtime only changes when its direct entries change, so an unchanged
+	// directory can reuse its cached listing and we only pay one stat for it
+	const qint64 mtime = dirInfo.lastModified().toMSecsSinceEpoch();
+	DirectoryManifest manifest = m_cachedManifests.value(dirPath);
+	if (manifest.mtime != mtime) {
+		const QDir dir(dirPath);
+		manifest.mtime = mtime;
+		manifest.desktopFiles = dir.entryList({ "*.desktop" }, QDir::Files);
+		manifest.subdirs = dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot | QDir::NoSymLinks);
+		if (verbose) {
+			qCDebug(sdaLog) << "XdgMimeApps: Listed" << dirPath;
+		}
+	}
+	manifests.insert(dirPath, manifest);
+
+	for (const QString &fileName : std::as_const(manifest.desktopFiles)) {
+		if (m_cancel && *m_cancel) {
+			return;
+		}
+		const QString desktopId = idPrefix + fileName;
+		if (m_desktopIds.contains(desktopId) || m_hiddenDesktopIds.contains(desktopId)) {
+			continue;
+		}
+		if (loadDesktopFile(dirPath + '/' + fileName, desktopId, verbose)) {
+			m_desktopIds.insert(desktopId);
+			m_desktopIdRanks.insert(desktopId, m_desktopIdRanks.size());
+		} else {
+			m_hiddenDesktopIds.insert(desktopId);
+		}
+	}
+
+	for (const QString &subdir : std::as_const(manifest.subdirs)) {
+		scanApplicationsDirectory(dirPath + '/' + subdir, idPrefix + subdir + '-', manifests, verbose);
+	}
+}
+
+QString XdgMimeApps::directoryManifestCachePath()
+{
+	// Not CacheLocation, the application name differs between the GUI and command line modes
+	return QDir(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation))
+		.absoluteFilePath("sda-qt6/application-dirs.cache");
+}
+
+QHash<QString, XdgMimeApps::DirectoryManifest> XdgMimeApps::readDirectoryManifests()
+{
+	QHash<QString, DirectoryManifest> manifests;
+	QFile file(directoryManifestCachePath());
+	if (!file.open(QIODevice::ReadOnly)) {
+		return manifests;
+	}
+
+	QDataStream in(&file);
+	quint32 version = 0;
+	in >> version;
+	if (version != MANIFEST_CACHE_VERSION) {
+		return manifests;
+	}
+
+	quint32 count = 0;
+	in >> count;
+	for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+		QString path;
+		DirectoryManifest manifest;
+		in >> path >> manifest.mtime >> manifest.desktopFiles >> manifest.subdirs;
+		manifests.insert(path, manifest);
+	}
+
+	if (in.status() != QDataStream::Ok) {
+		qCWarning(sdaLog) << "XdgMimeApps: Ignoring corrupt cache" << file.fileName();
+		manifests.clear();
+	}
+	return manifests;
+}
+
+void XdgMimeApps::writeDirectoryManifests(const QHash<QString, DirectoryManifest> &manifests)
+{
+	const QString cachePath = directoryManifestCachePath();
+	QDir().mkpath(QFileInfo(cachePath).absolutePath());
+
+	QSaveFile file(cachePath);
+	if (!file.open(QIODevice::WriteOnly)) {
+		qCWarning(sdaLog) << "XdgMimeApps: Failed to write" << cachePath << file.errorString();
+		return;
+	}
+
+	QDataStream out(&file);
+	out << MANIFEST_CACHE_VERSION << quint32(manifests.size());
+	for (auto it = manifests.begin(); it != manifests.end(); ++it) {
+		out << it.key() << it->mtime << it->desktopFiles << it->subdirs;
+	}
+	file.commit();
+}
+
+bool XdgMimeApps::loadDesktopFile(const QString &filePath, const QString &desktopId, bool verbose)
+{
+	using DesktopEntryKeys::Key;
+
 	QFile file(filePath);
-	if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+	if (!file.open(QIODevice::ReadOnly)) {
 		if (verbose) {
 			qCWarning(sdaLog) << "XdgMimeApps: Failed to open" << filePath;
 		}
-		return;
+		// Nothing can launch an entry nobody can read, it still masks the ID like a hidden one
+		return false;
 	}
 
-	QFileInfo fileInfo(filePath);
-	const QString appFile = fileInfo.fileName();
-	QString appName;
-	QString appIcon;
-	QStringList mimetypes;
+	RuntimeStats::add(RuntimeStats::FilesOpened);
+
+	ParseScope scope;
+	const QByteArrayView data = scope.read(file);
+	RuntimeStats::add(RuntimeStats::BytesRead, data.size());
+
+	// Views into data, only turned into strings once the whole entry is known
+	const QString &appFile = desktopId;
+	QByteArrayView appName;
+	QByteArrayView localizedName;
+	qsizetype localizedNameRank = m_localizedNameKeys.size();
+	QByteArrayView appIcon;
+	QByteArrayView mimetypes;
+	QByteArrayView tryExec;
+	QByteArrayView exec;
+	QByteArrayView onlyShowIn;
+	QByteArrayView notShowIn;
+
+	// Entries that don't apply are dropped as soon as the deciding key is seen.
+	// NoDisplay entries are kept, the specification allows them for MIME associations,
+	// and so are OnlyShowIn/NotShowIn ones, which only decide where they are listed.
+	const auto drop = [&](const char *reason) {
+		if (verbose) {
+			qCDebug(sdaLog) << "XdgMimeApps: Ignoring" << desktopId << reason;
+		}
+		return false;
+	};
 
-	QTextStream in(&file);
 	bool inDesktopEntry = false;
-
-	while (!in.atEnd()) {
-		QString line = in.readLine().trimmed();
+	for (qsizetype pos = 0; pos < data.size();) {
+		const QByteArrayView line = nextLine(data, pos);
 		if (line.isEmpty() || line.startsWith('#'))
 			continue;
 
@@ -299,55 +919,197 @@ void XdgMimeApps::loadDesktopFile(const QString &filePath, bool verbose)
 		if (!inDesktopEntry)
 			continue;
 
-		const int eqPos = line.indexOf('=');
+		const qsizetype eqPos = line.indexOf('=');
 		if (eqPos <= 0)
 			continue;
 
-		const QStringView key = QStringView(line).left(eqPos).trimmed();
-		const QStringView value = QStringView(line).mid(eqPos + 1).trimmed();
+		const QByteArrayView key = line.first(eqPos).trimmed();
+		const QByteArrayView value = line.sliced(eqPos + 1).trimmed();
+		const DesktopEntryKeys::Classified classified =
+			DesktopEntryKeys::classify(std::string_view(key.data(), size_t(key.size())));
+		// Only Name is looked up per locale, Hidden[de] or MimeType[de] are different keys
+		if (!classified.locale.empty() && classified.key != Key::Name) {
+			continue;
+		}
 
-		if (key == "Name") {
-			appName = value.toString();
-		} else if (key == "MimeType") {
-			mimetypes = value.toString().split(';', Qt::SkipEmptyParts);
-		} else if (key == "Icon") {
-			appIcon = value.toString();
+		switch (classified.key) {
+		case Key::Name:
+			if (classified.locale.empty()) {
+				appName = value;
+				break;
+			}
+			for (qsizetype rank = 0; rank < localizedNameRank; rank++) {
+				if (key == m_localizedNameKeys[rank]) {
+					localizedName = value;
+					localizedNameRank = rank;
+					break;
+				}
+			}
+			break;
+		case Key::MimeType:
+			mimetypes = value;
+			break;
+		case Key::Icon:
+			appIcon = value;
+			break;
+		case Key::TryExec:
+			tryExec = value;
+			break;
+		case Key::Exec:
+			exec = value;
+			break;
+		case Key::Type:
+			if (value != "Application") {
+				return drop("(not an application)");
+			}
+			break;
+		case Key::Hidden:
+			if (value == "true") {
+				return drop("(hidden)");
+			}
+			break;
+		case Key::OnlyShowIn:
+			onlyShowIn = value;
+			break;
+		case Key::NotShowIn:
+			notShowIn = value;
+			break;
+		default:
+			break;
 		}
 	}
 
-	if (appName.isEmpty()) {
-		appName = fileInfo.baseName();
+	// TryExec is what the spec checks, without it the program Exec runs is just as telling
+	const QByteArrayView program = tryExec.isEmpty() ? ExecutableIndex::execProgram(exec) : tryExec;
+	if (!m_executables.contains(program)) {
+		return drop("(program not installed)");
+	}
+
+	const QString name = appName.isEmpty() ? QFileInfo(filePath).baseName() : QString::fromUtf8(appName);
+
+	if (!appIcon.isEmpty() && m_applicationIcons[name].isEmpty()) {
+		m_applicationIcons[name] = QString::fromUtf8(appIcon);
+	}
+	if (!localizedName.isEmpty() && !m_localizedNames.contains(name)) {
+		m_localizedNames.insert(name, QString::fromUtf8(localizedName));
 	}
 
-	if (!appIcon.isEmpty() && m_applicationIcons[appName].isEmpty()) {
-		m_applicationIcons[appName] = appIcon;
+	if (!onlyShowIn.isEmpty() || !notShowIn.isEmpty()) {
+		m_desktopRestrictions.insert(desktopId, { desktopNames(onlyShowIn), desktopNames(notShowIn) });
 	}
 
 	if (mimetypes.isEmpty())
-		return;
+		return true;
 
-	for (const QString &readMimeName : mimetypes) {
-		const QString mimetypeName = normalizeMimeType(readMimeName);
+	for (const QByteArrayView readMimeName : splitList(mimetypes, scope.resource())) {
+		const QString mimetypeName = normalizeMimeType(QString::fromUtf8(readMimeName));
 		if (mimetypeName.isEmpty())
 			continue;
 
-		const QMimeType mimetype = m_mimeDb.mimeTypeForName(mimetypeName);
-		const QStringList parents = mimetype.parentMimeTypes();
-		for (const QString &parent : parents) {
-			if (parent != "application/octet-stream") {
-				m_childMimeTypes.insert(parent, mimetypeName);
-			}
-		}
-
 		if (mimetypeName.contains('/')) {
 			m_mimegroups.insert(mimetypeName.section('/', 0, 0));
 		}
 
+		if (m_onApplicationFound && !m_apps.contains(name) && isShownOnDesktops(desktopId)) {
+			m_onApplicationFound(name);
+		}
+
 		// Higher priority directories are scanned first
-		if (!m_apps[appName].contains(mimetypeName)) {
-			m_apps[appName][mimetypeName] = appFile;
+		if (!m_apps[name].contains(mimetypeName)) {
+			m_apps[name][mimetypeName] = appFile;
 		}
 	}
+	return true;
+}
+
+bool XdgMimeApps::isShownOnDesktops(const QString &desktopId) const
+{
+	const auto restriction = m_desktopRestrictions.constFind(desktopId);
+	if (m_environment.desktops.isEmpty() || restriction == m_desktopRestrictions.constEnd()) {
+		return true;
+	}
+	const auto listed = [this](const QStringList &names) {
+		return std::any_of(m_environment.desktops.begin(), m_environment.desktops.end(),
+				   [&names](const QString &desktop) { return names.contains(desktop, Qt::CaseInsensitive); });
+	};
+	if (!restriction->onlyShowIn.isEmpty() && !listed(restriction->onlyShowIn)) {
+		return false;
+	}
+	return !listed(restriction->notShowIn);
+}
+
+bool XdgMimeApps::isApplicationShown(const QString &appName) const
+{
+	const QHash<QString, QString> desktopIds = m_apps.value(appName);
+	return std::any_of(desktopIds.begin(), desktopIds.end(),
+			   [this](const QString &desktopId) { return isShownOnDesktops(desktopId); });
+}
+
+void XdgMimeApps::buildFileNameIndex()
+{
+	m_extensionMimeTypes.clear();
+	m_fileNameMimeTypes.clear();
+	m_otherGlobs.clear();
+
+	static const QRegularExpression wildcards(QStringLiteral("[*?\\[]"));
+	const QList<QMimeType> allMimeTypes = QMimeDatabase().allMimeTypes();
+	for (const QMimeType &mimetype : allMimeTypes) {
+		const QString mimetypeName = normalizeMimeType(mimetype.name());
+		for (const QString &pattern : mimetype.globPatterns()) {
+			const QString glob = pattern.toLower();
+			if (glob.startsWith("*.") && !glob.mid(2).contains(wildcards)) {
+				m_extensionMimeTypes[glob.mid(2)].append(mimetypeName);
+			} else if (!glob.contains(wildcards)) {
+				m_fileNameMimeTypes[glob].append(mimetypeName);
+			} else {
+				m_otherGlobs.append(
+					{ QRegularExpression(QRegularExpression::wildcardToRegularExpression(glob)),
+					  mimetypeName });
+			}
+		}
+	}
+}
+
+QStringList XdgMimeApps::mimeTypesForFileName(const QString &fileName) const
+{
+	QString name = fileName.trimmed().toLower();
+	// Also accept paths, only the last component is matched
+	name = name.mid(name.lastIndexOf('/') + 1);
+	if (name.startsWith("*.")) {
+		name.remove(0, 2);
+	} else if (name.startsWith('.')) {
+		name.remove(0, 1);
+	}
+	if (name.isEmpty()) {
+		return {};
+	}
+
+	const auto literal = m_fileNameMimeTypes.constFind(name);
+	if (literal != m_fileNameMimeTypes.constEnd()) {
+		return *literal;
+	}
+
+	// The whole name as a bare extension ("tar.gz"), then every suffix after a dot, longest first
+	qsizetype start = 0;
+	while (true) {
+		const auto extension = m_extensionMimeTypes.constFind(name.mid(start));
+		if (extension != m_extensionMimeTypes.constEnd()) {
+			return *extension;
+		}
+		const qsizetype dot = name.indexOf('.', start);
+		if (dot == -1) {
+			break;
+		}
+		start = dot + 1;
+	}
+
+	QStringList result;
+	for (const auto &[regex, mimetypeName] : m_otherGlobs) {
+		if (regex.match(name).hasMatch() && !result.contains(mimetypeName)) {
+			result.append(mimetypeName);
+		}
+	}
+	return result;
 }
 
 QString XdgMimeApps::normalizeMimeType(const QString &name)
@@ -358,27 +1120,65 @@ QString XdgMimeApps::normalizeMimeType(const QString &name)
 		return name;
 	}
 
-	QMimeType mimetype = m_mimeDb.mimeTypeForName(name);
-	if (!mimetype.isValid()) {
-		return QString();
+	const auto cached = m_normalizedMimeTypes.constFind(name);
+	if (cached != m_normalizedMimeTypes.constEnd()) {
+		RuntimeStats::add(RuntimeStats::MimeCacheHits);
+		return *cached;
 	}
 
-	QString mimetypeName = mimetype.name();
-	// Workaround for QTBUG-99509
-	if (mimetypeName == "application/pkcs12") {
-		mimetypeName = "application/x-pkcs12";
+	const QString mimetypeName = lookupMimeType(name);
+	m_normalizedMimeTypes.insert(name, mimetypeName);
+	return mimetypeName;
+}
+
+QString XdgMimeApps::normalizeMimeType(const QString &name) const
+{
+	// Shared snapshots may be read from several threads, so this one only reads the cache
+	if (name.startsWith(u"x-scheme-handler/")) {
+		return name;
+	}
+
+	const auto cached = m_normalizedMimeTypes.constFind(name);
+	if (cached != m_normalizedMimeTypes.constEnd()) {
+		RuntimeStats::add(RuntimeStats::MimeCacheHits);
+		return *cached;
+	}
+	return lookupMimeType(name);
+}
+
+QString XdgMimeApps::lookupMimeType(const QString &name)
+{
+	QMimeType mimetype = QMimeDatabase().mimeTypeForName(name);
+	RuntimeStats::add(RuntimeStats::MimeLookups);
+	QString mimetypeName;
+	if (mimetype.isValid()) {
+		mimetypeName = mimetype.name();
+		// Workaround for QTBUG-99509
+		if (mimetypeName == "application/pkcs12") {
+			mimetypeName = "application/x-pkcs12";
+		}
 	}
 	return mimetypeName;
 }
 
-void XdgMimeApps::setDefaults(const QString &appFile, const QSet<QString> &mimeTypes)
+QSet<QString> XdgMimeApps::setDefaults(const QString &appFile, const QSet<QString> &mimeTypes)
 {
-	if (mimeTypes.isEmpty()) {
-		return;
+	QHash<QString, QString> defaults;
+	for (const QString &mimeType : mimeTypes) {
+		defaults.insert(mimeType, appFile);
 	}
+	QSet<QString> changedMimeTypes;
+	setDefaults(defaults, &changedMimeTypes);
+	return changedMimeTypes;
+}
 
-	const QString filePath =
-		QDir(QStandardPaths::writableLocation(QStandardPaths::ConfigLocation)).absoluteFilePath("mimeapps.list");
+bool XdgMimeApps::setDefaults(const QHash<QString, QString> &defaults, QSet<QString> *changedMimeTypes)
+{
+	if (defaults.isEmpty()) {
+		return true;
+	}
+
+	const QString filePath = m_environment.userMimeAppsListPath();
 	QFile file(filePath);
 
 	// Read in existing mimeapps.list, skipping the lines for the mimetypes we're updating
@@ -415,7 +1215,7 @@ void XdgMimeApps::setDefaults(const QString &appFile, const QSet<QString> &mimeT
 			const QString mimetype =
 				normalizeMimeType(QString::fromUtf8(line.split('=').first().trimmed()));
 			// If we aren't setting this mimetype, leave any entry
-			if (!mimeTypes.contains(mimetype)) {
+			if (!defaults.contains(mimetype)) {
 				existingAssociations.append(line);
 				continue;
 			}
@@ -423,37 +1223,128 @@ void XdgMimeApps::setDefaults(const QString &appFile, const QSet<QString> &mimeT
 		file.close();
 	}
 
-	// Write the file
-	if (!file.open(QIODevice::WriteOnly)) {
-		qWarning() << "XdgMimeApps: Failed to write to" << filePath << file.errorString();
-		return;
+	// Write the file atomically, readers never see a half-written mimeapps.list
+	QDir().mkpath(QFileInfo(filePath).absolutePath());
+	QSaveFile saveFile(filePath);
+	if (!saveFile.open(QIODevice::WriteOnly)) {
+		qWarning() << "XdgMimeApps: Failed to write to" << filePath << saveFile.errorString();
+		return false;
 	}
 
 	for (const QByteArray &line : existingContent) {
-		file.write(line + '\n');
+		saveFile.write(line + '\n');
 	}
-	file.write("\n[Default Applications]\n");
+	saveFile.write("\n[Default Applications]\n");
 	for (const QByteArray &line : existingAssociations) {
-		file.write(line + '\n');
+		saveFile.write(line + '\n');
 	}
 
-	QStringList selectedMimetypes = mimeTypes.values();
+	QStringList selectedMimetypes = defaults.keys();
 	selectedMimetypes.sort();
 	for (const QString &mimetype : selectedMimetypes) {
-		file.write(QString(mimetype + '=' + appFile + '\n').toUtf8());
+		const QString appFile = defaults.value(mimetype);
+		saveFile.write(QString(mimetype + '=' + appFile + '\n').toUtf8());
 		qCDebug(sdaLog) << "XdgMimeApps: Writing setting:" << mimetype << "=" << appFile;
 	}
-	file.close();
+	if (!saveFile.commit()) {
+		qWarning() << "XdgMimeApps: Failed to write to" << filePath << saveFile.errorString();
+		return false;
+	}
+
+	// Apply the same edit to the parsed user file instead of reading everything again
+	MimeAppsList &userConfig = userConfigLayer();
+	QSet<QString> touched = removeNormalizedKeys(userConfig.defaults, defaults);
+	for (auto it = defaults.begin(); it != defaults.end(); ++it) {
+		userConfig.defaults.insert(it.key(), { it.value() });
+		touched.insert(it.key());
+	}
+	const QSet<QString> changed = updateResolved(touched);
+	if (changedMimeTypes) {
+		*changedMimeTypes = changed;
+	}
+	return true;
+}
+
+MimeAppsList &XdgMimeApps::userConfigLayer()
+{
+	const QString userConfig = m_environment.userMimeAppsListPath();
+	const QStringList paths = getMimeAppsListPaths();
+	const qsizetype userRank = paths.indexOf(userConfig);
+	qsizetype insertAt = 0;
+	for (; insertAt < m_configFiles.size(); insertAt++) {
+		if (m_configFiles[insertAt].path == userConfig) {
+			return m_configFiles[insertAt];
+		}
+		if (paths.indexOf(m_configFiles[insertAt].path) > userRank) {
+			break;
+		}
+	}
+
+	// The file didn't exist when the configs were loaded
+	MimeAppsList list;
+	list.path = userConfig;
+	m_configFiles.insert(insertAt, list);
+	return m_configFiles[insertAt];
 }
 
-void XdgMimeApps::removeDefaults(const QSet<QString> &mimeTypes)
+template<typename T>
+QSet<QString> XdgMimeApps::removeNormalizedKeys(QHash<QString, QStringList> &group, const T &mimeTypes)
+{
+	// Matches the writers, which drop every line whose key normalizes to one of the MIME types
+	QSet<QString> removed;
+	for (auto it = group.begin(); it != group.end();) {
+		if (mimeTypes.contains(normalizeMimeType(it.key()))) {
+			removed.insert(it.key());
+			it = group.erase(it);
+		} else {
+			++it;
+		}
+	}
+	return removed;
+}
+
+QSet<QString> XdgMimeApps::updateResolved(const QSet<QString> &mimeTypes)
+{
+	QSet<QString> changed;
+	const QString userConfig = m_environment.userMimeAppsListPath();
+	for (const QString &mimeType : mimeTypes) {
+		const QString before = m_defaults.value(mimeType);
+		m_defaults.remove(mimeType);
+		m_defaultSources.remove(mimeType);
+		m_userDefaults.remove(mimeType);
+		m_addedAssociations.remove(mimeType);
+
+		// Same rules as resolveConfigs(), for one key
+		for (const MimeAppsList &list : std::as_const(m_configFiles)) {
+			const QStringList desktopIds = list.defaults.value(mimeType);
+			if (!desktopIds.isEmpty() && !m_defaults.contains(mimeType)) {
+				m_defaults.insert(mimeType, desktopIds.first());
+				m_defaultSources.insert(mimeType, list.path);
+			}
+			if (list.path == userConfig && list.defaults.contains(mimeType)) {
+				m_userDefaults.insert(mimeType);
+			}
+			if (!list.desktopSpecific) {
+				for (const QString &desktopId : list.addedAssociations.value(mimeType)) {
+					m_addedAssociations.insert(mimeType, desktopId);
+				}
+			}
+		}
+
+		if (m_defaults.value(mimeType) != before) {
+			changed.insert(mimeType);
+		}
+	}
+	return changed;
+}
+
+QSet<QString> XdgMimeApps::removeDefaults(const QSet<QString> &mimeTypes)
 {
 	if (mimeTypes.isEmpty()) {
-		return;
+		return {};
 	}
 
-	const QString filePath =
-		QDir(QStandardPaths::writableLocation(QStandardPaths::ConfigLocation)).absoluteFilePath("mimeapps.list");
+	const QString filePath = m_environment.userMimeAppsListPath();
 	QFile file(filePath);
 
 	QList<QByteArray> existingContent;
@@ -499,13 +1390,191 @@ void XdgMimeApps::removeDefaults(const QSet<QString> &mimeTypes)
 		file.close();
 	}
 
-	if (!file.open(QIODevice::WriteOnly)) {
-		qWarning() << "XdgMimeApps: Failed to write to" << filePath << file.errorString();
-		return;
+	QSaveFile saveFile(filePath);
+	if (!saveFile.open(QIODevice::WriteOnly)) {
+		qWarning() << "XdgMimeApps: Failed to write to" << filePath << saveFile.errorString();
+		return {};
 	}
 
 	for (const QByteArray &line : existingContent) {
-		file.write(line + '\n');
+		saveFile.write(line + '\n');
+	}
+	if (!saveFile.commit()) {
+		qWarning() << "XdgMimeApps: Failed to write to" << filePath << saveFile.errorString();
+		return {};
+	}
+
+	MimeAppsList &userConfig = userConfigLayer();
+	QSet<QString> touched = removeNormalizedKeys(userConfig.defaults, mimeTypes);
+	touched.unite(removeNormalizedKeys(userConfig.addedAssociations, mimeTypes));
+	touched.unite(mimeTypes);
+	return updateResolved(touched);
+}
+
+XdgMimeApps::CompactionReport XdgMimeApps::compactUserConfig(bool write)
+{
+	CompactionReport report;
+	const QString filePath = m_environment.userMimeAppsListPath();
+	QFile file(filePath);
+	if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+		return report;
+	}
+	RuntimeStats::add(RuntimeStats::FilesOpened);
+	RuntimeStats::add(RuntimeStats::BytesRead, file.size());
+
+	// Associations that MimeType= lines already provide don't need an [Added Associations] entry
+	QSet<QPair<QString, QString> > declared;
+	for (auto app = m_apps.begin(); app != m_apps.end(); ++app) {
+		for (auto it = app->begin(); it != app->end(); ++it) {
+			declared.insert({ it.key(), *it });
+		}
+	}
+
+	enum Group { Defaults, Added, Removed, Other };
+	QMap<QString, QStringList> entries[Other];
+	// Comments in the known groups move with the key that follows them, or stay at the group's end
+	QMap<QString, QList<QByteArray> > comments[Other];
+	QList<QByteArray> trailingComments[Other];
+	QList<QByteArray> pendingComments;
+	QList<QByteArray> otherContent;
+	Group group = Other;
+
+	while (!file.atEnd()) {
+		const QByteArray rawLine = file.readLine().trimmed();
+		if (rawLine.isEmpty()) {
+			continue;
+		}
+		report.linesBefore++;
+		const QString line = QString::fromUtf8(rawLine);
+
+		if (line.startsWith('[')) {
+			if (group != Other) {
+				trailingComments[group] += pendingComments;
+			}
+			pendingComments.clear();
+			if (line == "[Default Applications]") {
+				group = Defaults;
+			} else if (line == "[Added Associations]") {
+				group = Added;
+			} else if (line == "[Removed Associations]") {
+				group = Removed;
+			} else {
+				group = Other;
+				otherContent.append(rawLine);
+			}
+			continue;
+		}
+
+		// Comments and unknown groups are kept as they are
+		if (group == Other) {
+			otherContent.append(rawLine);
+			continue;
+		}
+		if (line.startsWith('#') || !line.contains('=')) {
+			pendingComments.append(rawLine);
+			continue;
+		}
+
+		const QString key = line.section('=', 0, 0).trimmed();
+		// Scheme handlers and the like aren't in the MIME database, keep those keys verbatim
+		const QString normalized = normalizeMimeType(key);
+		const QString mimeType = normalized.isEmpty() ? key : normalized;
+		comments[group][mimeType] += pendingComments;
+		pendingComments.clear();
+		const bool seen = entries[group].contains(mimeType);
+		if (seen && group == Defaults) {
+			// Only the first default for a key is ever used
+			report.problems.append(QString("duplicate %1").arg(line));
+			continue;
+		}
+		if (seen) {
+			report.problems.append(QString("merged duplicate key %1").arg(key));
+		}
+
+		QStringList &desktopIds = entries[group][mimeType];
+		const QStringList values = line.section('=', 1, -1).split(';', Qt::SkipEmptyParts);
+		for (const QString &value : values) {
+			const QString desktopId = value.trimmed();
+			if (desktopId.isEmpty() || desktopIds.contains(desktopId)) {
+				continue;
+			}
+			// A removal must outlive the application, reinstalling it would bring the association back
+			if (group != Removed && !hasDesktopId(desktopId)) {
+				report.problems.append(QString("stale %1=%2").arg(mimeType, desktopId));
+				continue;
+			}
+			desktopIds.append(desktopId);
+		}
 	}
 	file.close();
+	if (group != Other) {
+		trailingComments[group] += pendingComments;
+	}
+
+	for (auto added = entries[Added].begin(); added != entries[Added].end(); ++added) {
+		const QStringList removed = entries[Removed].value(added.key());
+		// An installed default decides before added associations do, so the ones the
+		// application declares anyway no longer change anything
+		const bool hasDefault = !entries[Defaults].value(added.key()).isEmpty();
+		for (auto it = added->begin(); it != added->end();) {
+			if (removed.contains(*it)) {
+				// Removed in the same file wins over added
+				report.problems.append(QString("added and removed %1=%2").arg(added.key(), *it));
+				it = added->erase(it);
+			} else if (hasDefault && declared.contains({ added.key(), *it })) {
+				report.problems.append(QString("redundant %1=%2").arg(added.key(), *it));
+				it = added->erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	// Canonical layout: known groups first with sorted keys, anything else kept verbatim after them
+	static const char *const groupNames[] = { "[Default Applications]", "[Added Associations]",
+						  "[Removed Associations]" };
+	QByteArray content;
+	for (int i = Defaults; i < Other; i++) {
+		QByteArray lines;
+		for (auto it = entries[i].begin(); it != entries[i].end(); ++it) {
+			for (const QByteArray &comment : comments[i].value(it.key())) {
+				lines += comment + '\n';
+				report.linesAfter++;
+			}
+			if (it->isEmpty()) {
+				continue;
+			}
+			// Defaults are written like setDefaults() does, association lists keep the spec's trailing ';'
+			const QString value = i == Defaults ? it->join(';') : it->join(';') + ';';
+			lines += QString(it.key() + '=' + value + '\n').toUtf8();
+			report.linesAfter++;
+		}
+		for (const QByteArray &comment : std::as_const(trailingComments[i])) {
+			lines += comment + '\n';
+			report.linesAfter++;
+		}
+		if (!lines.isEmpty()) {
+			content += QByteArray(groupNames[i]) + '\n' + lines + '\n';
+			report.linesAfter++;
+		}
+	}
+	for (const QByteArray &line : std::as_const(otherContent)) {
+		content += line + '\n';
+		report.linesAfter++;
+	}
+
+	if (!write || report.problems.isEmpty()) {
+		return report;
+	}
+
+	QSaveFile saveFile(filePath);
+	if (!saveFile.open(QIODevice::WriteOnly) || saveFile.write(content) != content.size() || !saveFile.commit()) {
+		qWarning() << "XdgMimeApps: Failed to write to" << filePath << saveFile.errorString();
+		report.failed = true;
+		return report;
+	}
+	report.written = true;
+	qCDebug(sdaLog) << "XdgMimeApps: Compacted" << filePath << "from" << report.linesBefore << "to"
+			<< report.linesAfter << "lines";
+	return report;
 }
@@ -4,41 +4,234 @@
 #include <QLoggingCategory>
 #include <QMimeDatabase>
 #include <QMultiHash>
+#include <QRegularExpression>
 #include <QSet>
 #include <QString>
 #include <QStringList>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include "executableindex.h"
+#include "mimehierarchy.h"
+
+/**
+ * @brief The XDG base directories one set of associations is resolved against.
+ *
+ * current() describes the running user. forHome() points the per-user locations at
+ * another home directory while keeping the system ones, which is what fleet mode uses;
+ * its $PATH is the system part of the running user's plus the home's ~/.local/bin.
+ */
+struct XdgEnvironment {
+	QString configHome;
+	QStringList configDirs;
+	QString dataHome;
+	QStringList dataDirs;
+	QStringList desktops;
+	// $PATH, for checking that applications are installed
+	QStringList executableDirs;
+	// Prefix of absolute paths in desktop files, empty for this system
+	QString root;
+
+	static XdgEnvironment current();
+	XdgEnvironment forHome(const QString &home) const;
+	// Every directory moved below root, e.g. an unpacked container image
+	XdgEnvironment forRoot(const QString &root) const;
+	// Only the system directories, without any per-user locations
+	XdgEnvironment systemOnly() const;
+
+	/**
+	 * @brief mimeapps.list candidates in precedence order, highest first.
+	 */
+	QStringList mimeAppsListPaths() const;
+	QStringList applicationDirs() const;
+	QString userMimeAppsListPath() const;
+
+	bool operator==(const XdgEnvironment &other) const
+	{
+		return configHome == other.configHome && configDirs == other.configDirs && dataHome == other.dataHome &&
+		       dataDirs == other.dataDirs && desktops == other.desktops &&
+		       executableDirs == other.executableDirs && root == other.root;
+	}
+	bool operator!=(const XdgEnvironment &other) const
+	{
+		return !(*this == other);
+	}
+};
+
+/**
+ * @brief The parsed contents of one mimeapps.list file.
+ *
+ * Parsed files only depend on their path, so they can be shared between
+ * several XdgMimeApps resolving different environments.
+ */
+struct MimeAppsList {
+	QString path;
+	bool desktopSpecific = false;
+	// MIME type -> desktop IDs, the first occurrence of a key in a group wins
+	QHash<QString, QStringList> defaults;
+	QHash<QString, QStringList> addedAssociations;
+	QHash<QString, QStringList> removedAssociations;
+
+	static MimeAppsList parse(const QString &filePath, bool verbose = false);
+};
 
 /**
  * @brief Manages default application associations per XDG MIME Apps Specification.
  *
  * This class handles both the parsing of mimeapps.list files and the discovery
  * of .desktop files to provide a complete view of MIME associations.
+ *
+ * Instances are cheap to copy, all tables are implicitly shared. Once loaded, an
+ * instance can be published as an immutable XdgMimeAppsSnapshot and read from any
+ * thread through its const methods; edits go to a copy that is published in turn.
  */
 class XdgMimeApps {
 public:
-	XdgMimeApps();
+	explicit XdgMimeApps(const XdgEnvironment &environment = XdgEnvironment::current());
+
+	const XdgEnvironment &environment() const
+	{
+		return m_environment;
+	}
 
 	/**
 	 * @brief Load all mimeapps.list files in XDG precedence order.
+	 * @param parsedFiles Already parsed files by path, used instead of reading them again
 	 */
-	void loadAllConfigs(bool verbose = false);
+	void loadAllConfigs(bool verbose = false, const QHash<QString, MimeAppsList> &parsedFiles = {});
+
+	/**
+	 * @brief The mimeapps.list files found by the last loadAllConfigs(), highest precedence first.
+	 */
+	const QList<MimeAppsList> &getConfigFiles() const
+	{
+		return m_configFiles;
+	}
 
 	/**
 	 * @brief Discover and parse all .desktop files from standard XDG locations.
+	 *
+	 * Subdirectories are scanned recursively and files in them get the spec's
+	 * prefixed desktop ID (applications/kde4/foo.desktop -> kde4-foo.desktop).
+	 * Directory listings are cached between runs and reused while a directory's
+	 * mtime is unchanged.
 	 * @param verbose Enable debug logging
+	 * @param onApplicationFound Called with each application name the first time it is seen,
+	 *        e.g. to stream results into a GUI while loading continues
+	 * @param cancel Stops the scan early once set, leaving the applications incomplete
+	 */
+	void loadApplications(bool verbose = false,
+			      const std::function<void(const QString &appName)> &onApplicationFound = nullptr,
+			      const std::atomic<bool> *cancel = nullptr);
+
+	/**
+	 * @brief Take the applications of an already loaded instance and add the user's own.
+	 *
+	 * Desktop files from this environment's data home take precedence like in a full scan,
+	 * replacing (or hiding) system entries with the same desktop ID. Used to load the
+	 * system directories once for many users.
 	 */
-	void loadApplications(bool verbose = false);
+	void inheritApplications(const XdgMimeApps &system, bool verbose = false);
 
 	/**
 	 * @brief Get the default application for a MIME type.
 	 */
 	QString getDefaultApp(const QString &mimeType) const;
 
+	/**
+	 * @brief The mimeapps.list file the effective default for a MIME type comes from.
+	 */
+	QString getDefaultSource(const QString &mimeType) const;
+
+	/**
+	 * @brief The application that actually opens a MIME type, and where that choice comes from.
+	 */
+	struct EffectiveHandler {
+		QString desktopId;
+		// The mimeapps.list that selected it, empty if it only declares the type in MimeType=
+		QString source;
+
+		bool operator==(const EffectiveHandler &other) const
+		{
+			return desktopId == other.desktopId && source == other.source;
+		}
+	};
+
+	/**
+	 * @brief Resolve the handler of every known MIME type in one pass over the loaded data.
+	 *
+	 * Follows the spec's order: the first installed [Default Applications] entry of any
+	 * file, then [Added Associations] not removed by the same or a higher file, then the
+	 * application declaring the type from the most important directory. Needs
+	 * loadApplications() and loadAllConfigs().
+	 */
+	QHash<QString, EffectiveHandler> resolveEffectiveHandlers() const;
+
+	/**
+	 * @brief A copy that resolves associations like a session of other desktops would.
+	 *
+	 * Only the desktop-specific *-mimeapps.list layers differ between desktops, files found
+	 * in @p parsedFiles are not read again. Needs loadApplications().
+	 * @param desktops Lowercase desktop names in XDG_CURRENT_DESKTOP order
+	 */
+	XdgMimeApps forDesktops(const QStringList &desktops, bool verbose,
+				const QHash<QString, MimeAppsList> &parsedFiles = {}) const;
+
+	/**
+	 * @brief What setting a default in the user's mimeapps.list would run into.
+	 */
+	struct DefaultPreview {
+		// The installed default in effect now, and the file it comes from
+		QString currentDesktopId;
+		QString currentSource;
+		// A file with higher precedence than the user's mimeapps.list that would keep winning
+		QString shadowingDesktopId;
+		QString shadowingSource;
+	};
+
+	/**
+	 * @brief Preview setting defaults (MIME type -> desktop ID), computed from the loaded files only.
+	 *
+	 * Only MIME types that run into something are returned: another current default,
+	 * or a higher precedence file (e.g. ~/.config/kde-mimeapps.list) that would shadow the change.
+	 */
+	QHash<QString, DefaultPreview> previewDefaults(const QHash<QString, QString> &defaults) const;
+
 	/**
 	 * @brief Get associated applications for a MIME type.
 	 */
 	QStringList getAssociatedApps(const QString &mimeType) const;
 
+	/**
+	 * @brief Every application directory the last load scanned, subdirectories included.
+	 */
+	const QStringList &getScannedApplicationDirs() const
+	{
+		return m_scannedApplicationDirs;
+	}
+	/**
+	 * @brief Check if a desktop ID was found by the last loadApplications().
+	 */
+	bool hasDesktopId(const QString &desktopId) const
+	{
+		return m_desktopIds.contains(desktopId);
+	}
+
+	/**
+	 * @brief Check an entry's OnlyShowIn/NotShowIn against the environment's desktops.
+	 *
+	 * Always true without desktops, so one load can serve several sessions via forDesktops().
+	 */
+	bool isShownOnDesktops(const QString &desktopId) const;
+
+	/**
+	 * @brief Whether any of an application's desktop IDs is shown on the environment's desktops.
+	 *
+	 * Entries the desktops don't show stay installed for lookups and configuration,
+	 * they are only left out of application lists.
+	 */
+	bool isApplicationShown(const QString &appName) const;
+
 	/**
 	 * @brief Check if a MIME type has an explicit user-set default.
 	 */
@@ -47,17 +240,54 @@ public:
 	/**
 	 * @brief Set the default application for the given MIME types in the user's mimeapps.list.
 	 * 
+	 * The loaded associations are updated in place, no config file is read again.
 	 * @param appFile The .desktop file name (e.g. "org.kde.kate.desktop")
 	 * @param mimeTypes Set of MIME types to associate
+	 * @return The MIME types whose effective default changed
 	 */
-	void setDefaults(const QString &appFile, const QSet<QString> &mimeTypes);
+	QSet<QString> setDefaults(const QString &appFile, const QSet<QString> &mimeTypes);
+
+	/**
+	 * @brief Set several defaults, possibly to different applications, in one write.
+	 *
+	 * @param defaults MIME type -> desktop ID
+	 * @param changedMimeTypes If given, receives the MIME types whose effective default changed
+	 * @return false if the user's mimeapps.list could not be written
+	 */
+	bool setDefaults(const QHash<QString, QString> &defaults, QSet<QString> *changedMimeTypes = nullptr);
 
 	/**
 	 * @brief Remove the default application association for the given MIME types from the user's mimeapps.list.
 	 * 
 	 * @param mimeTypes Set of MIME types to remove associations for
+	 * @return The MIME types whose effective default changed, e.g. to a system default
+	 */
+	QSet<QString> removeDefaults(const QSet<QString> &mimeTypes);
+
+	/**
+	 * @brief Outcome of compactUserConfig().
+	 */
+	struct CompactionReport {
+		// One line per dropped or merged entry, e.g. "stale image/png=gimp.desktop"
+		QStringList problems;
+		int linesBefore = 0;
+		int linesAfter = 0;
+		bool written = false;
+		bool failed = false;
+	};
+
+	/**
+	 * @brief Check the user's mimeapps.list against the loaded applications and optionally rewrite it.
+	 *
+	 * Drops desktop IDs that are not installed (except in [Removed Associations], which
+	 * must survive a reinstall), repeated keys and IDs, aliases of the same
+	 * MIME type, and added associations the application already declares in MimeType=
+	 * when an explicit default makes their order irrelevant.
+	 * The result is written in one atomic pass with sorted groups, and only if something
+	 * was dropped; comments move along with the key that follows them. Needs loadApplications().
+	 * @param write false to only report
 	 */
-	void removeDefaults(const QSet<QString> &mimeTypes);
+	CompactionReport compactUserConfig(bool write);
 
 	// Data accessors for UI
 	const QHash<QString, QHash<QString, QString> > &getApps() const
@@ -68,29 +298,92 @@ public:
 	{
 		return m_applicationIcons;
 	}
-	const QMultiHash<QString, QString> &getChildMimeTypes() const
+	/**
+	 * @brief The Name[locale] of an application for the message locale, its Name otherwise.
+	 */
+	QString getDisplayName(const QString &appName) const
+	{
+		return m_localizedNames.value(appName, appName);
+	}
+	const MimeHierarchy &getMimeHierarchy() const
 	{
-		return m_childMimeTypes;
+		return m_mimeHierarchy;
 	}
 	const QSet<QString> &getMimeGroups() const
 	{
 		return m_mimegroups;
 	}
+	/**
+	 * @brief Names of the applications declaring support for a MIME type, sorted.
+	 */
+	QStringList getApplicationsForMimeType(const QString &mimeType) const
+	{
+		return m_mimeTypeApplications.value(mimeType);
+	}
+
+	/**
+	 * @brief MIME types matching a file name or extension, using the shared-mime-info globs.
+	 *
+	 * Accepts "photo.heic", "*.heic", ".heic" or "heic". The longest matching extension wins,
+	 * so "a.tar.gz" resolves through "tar.gz" before "gz". Simple globs are answered from a
+	 * hash table built by loadApplications(), only unusual patterns need a scan.
+	 */
+	QStringList mimeTypesForFileName(const QString &fileName) const;
 
 	/**
 	 * @brief Utility to normalize MIME type names and handle aliases.
 	 */
 	QString normalizeMimeType(const QString &name);
+	/**
+	 * @brief Same as above, but never adds to the cache, so it is safe on shared snapshots.
+	 */
+	QString normalizeMimeType(const QString &name) const;
 
 	static QStringList getCurrentDesktops();
+	static QStringList localizedKeys(const QString &key);
 	QStringList getMimeAppsListPaths() const;
 
 private:
-	void parseMimeAppsList(const QString &filePath, bool desktopSpecific, bool verbose);
-	void loadDesktopFile(const QString &filePath, bool verbose);
+	// Cached listing of one applications (sub)directory, valid while mtime matches
+	struct DirectoryManifest {
+		qint64 mtime = 0;
+		QStringList desktopFiles;
+		QStringList subdirs;
 
-	QStringList m_desktops;
+		bool operator==(const DirectoryManifest &other) const
+		{
+			return mtime == other.mtime && desktopFiles == other.desktopFiles && subdirs == other.subdirs;
+		}
+		bool operator!=(const DirectoryManifest &other) const
+		{
+			return !(*this == other);
+		}
+	};
+
+	void resolveConfigs();
+	// Re-resolves only the given keys after an edit of a parsed file, returns those whose default changed
+	QSet<QString> updateResolved(const QSet<QString> &mimeTypes);
+	MimeAppsList &userConfigLayer();
+	QString firstInstalled(const QStringList &desktopIds) const;
+	template<typename T>
+	QSet<QString> removeNormalizedKeys(QHash<QString, QStringList> &group, const T &mimeTypes);
+	void buildApplicationIndexes(bool verbose);
+	// False if the entry is unreadable, Hidden, not an application or its program is missing
+	bool loadDesktopFile(const QString &filePath, const QString &desktopId, bool verbose);
+	void buildFileNameIndex();
+	void scanApplicationsDirectory(const QString &dirPath, const QString &idPrefix,
+				       QHash<QString, DirectoryManifest> &manifests, bool verbose);
+
+	static QString lookupMimeType(const QString &name);
+	static QString directoryManifestCachePath();
+	static QHash<QString, DirectoryManifest> readDirectoryManifests();
+	static void writeDirectoryManifests(const QHash<QString, DirectoryManifest> &manifests);
+
+	XdgEnvironment m_environment;
+	QList<MimeAppsList> m_configFiles;
 	QHash<QString, QString> m_defaults;
+	// MIME type -> mimeapps.list the effective default was read from
+	QHash<QString, QString> m_defaultSources;
 	QMultiHash<QString, QString> m_addedAssociations;
 	QMultiHash<QString, QString> m_removedAssociations;
 	QSet<QString> m_userDefaults;
@@ -98,10 +391,41 @@ private:
 	// Application data
 	QHash<QString, QHash<QString, QString> > m_apps;
 	QHash<QString, QString> m_applicationIcons;
-	QMultiHash<QString, QString> m_childMimeTypes;
+	// Application name (the untranslated Name) -> best matching Name[locale]
+	QHash<QString, QString> m_localizedNames;
+	// Name[...] keys to look for, best match first
+	QList<QByteArray> m_localizedNameKeys;
+	MimeHierarchy m_mimeHierarchy;
+	// Inverse of m_apps: MIME type -> application names
+	QHash<QString, QStringList> m_mimeTypeApplications;
+	// Glob index: lower-case extension ("tar.gz") or literal file name ("makefile") -> MIME types
+	QHash<QString, QStringList> m_extensionMimeTypes;
+	QHash<QString, QStringList> m_fileNameMimeTypes;
+	// Globs that are neither, e.g. "*-gzip", matched with wildcards as a last resort
+	QList<QPair<QRegularExpression, QString> > m_otherGlobs;
 	QSet<QString> m_mimegroups;
-
-	QMimeDatabase m_mimeDb;
+	// normalizeMimeType() results, the database lookup is comparatively expensive
+	QHash<QString, QString> m_normalizedMimeTypes;
+	// Desktop IDs seen so far; the first directory providing an ID masks the others
+	QSet<QString> m_desktopIds;
+	// Desktop ID -> position in the scan, lower ranks come from more important directories
+	QHash<QString, qsizetype> m_desktopIdRanks;
+	// OnlyShowIn/NotShowIn of the entries that have them, lower-case like XdgEnvironment::desktops
+	struct DesktopRestriction {
+		QStringList onlyShowIn;
+		QStringList notShowIn;
+	};
+	QHash<QString, DesktopRestriction> m_desktopRestrictions;
+	// Desktop IDs of hidden entries or missing programs, which still mask the same ID in lower directories
+	QSet<QString> m_hiddenDesktopIds;
+	QHash<QString, DirectoryManifest> m_cachedManifests;
+	QStringList m_scannedApplicationDirs;
+	ExecutableIndex m_executables;
+	std::function<void(const QString &appName)> m_onApplicationFound;
+	const std::atomic<bool> *m_cancel = nullptr;
 };
 
+// A published, read-only XdgMimeApps; see AtomicSnapshot for sharing it between threads
+using XdgMimeAppsSnapshot = std::shared_ptr<const XdgMimeApps>;
+
 Q_DECLARE_LOGGING_CATEGORY(sdaLog);